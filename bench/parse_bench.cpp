@@ -0,0 +1,90 @@
+/**
+ * Parse throughput benchmark for the bundled rapidxml parser.
+ *
+ * Usage: parse_bench [project.xml]
+ *
+ * Without an argument a machine-generated project of several megabytes is
+ * used. Each parse mode is timed with every scanning implementation the cpu
+ * supports (scalar lookup tables, SSE2, AVX2).
+ */
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "../rapidxml.hpp"
+
+using namespace std;
+using namespace rapidxml;
+
+string generate_project() {
+	string xml = "<?xml version=\"1.0\"?>\n<project>\n";
+	char line[256];
+	for (int i = 0; i < 100; i++) {
+		snprintf(line, sizeof(line), "\t<include os=\"linux\">third_party/lib%d/include;src/module%d</include>\n", i, i);
+		xml += line;
+		snprintf(line, sizeof(line), "\t<flags type=\"pp\" config=\"release\">MODULE_%d=1;NDEBUG;FEATURE_LEVEL=3</flags>\n", i);
+		xml += line;
+	}
+	for (int i = 0; i < 60000; i++) {
+		snprintf(line, sizeof(line), "\t<source os=\"linux\" arch=\"64\">src/module%d/generated/file_%05d.cpp</source>\n", i % 100, i);
+		xml += line;
+	}
+	xml += "\t<output type=\"app\">generated</output>\n</project>\n";
+	return xml;
+}
+
+int load_file(const char* path, string& xml) {
+	FILE* fp = fopen(path, "rb");
+	if (fp == NULL) return 0;
+	char buf[65536];
+	size_t read;
+	while ((read = fread(buf, 1, sizeof(buf), fp)) > 0) xml.append(buf, read);
+	fclose(fp);
+	return 1;
+}
+
+template<int Flags>
+double bench_parse(const string& xml, vector<char>& buffer, int iterations) {
+	double best = 0;
+	xml_document<>* doc = new xml_document<>();
+	for (int i = 0; i < iterations; i++) {
+		//Destructive parses modify the text, so every iteration gets a fresh copy.
+		memcpy(buffer.data(), xml.c_str(), xml.size() + 1);
+		auto start = chrono::steady_clock::now();
+		doc->parse<Flags>(buffer.data());
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		doc->clear();
+		double mbs = xml.size() / elapsed.count() / (1024 * 1024);
+		if (mbs > best) best = mbs;
+	}
+	delete doc;
+	return best;
+}
+
+int main(int argc, char** argv) {
+	string xml;
+	if (argc > 1) {
+		if (!load_file(argv[1], xml)) {
+			fprintf(stderr, "Error: Could not open %s.\n", argv[1]);
+			return 1;
+		}
+	}
+	else xml = generate_project();
+
+	vector<char> buffer(xml.size() + 1);
+	const int iterations = 10;
+	const char* levels[] = { "scalar", "sse2", "avx2" };
+	int best = set_simd_level(99);
+
+	printf("Input: %.2f MB, best of %d parses (MB/s)\n", xml.size() / (1024.0 * 1024), iterations);
+	printf("%-8s %14s %14s %14s\n", "scan", "parse<0>", "non_destruct", "fastest");
+	for (int level = 0; level <= best; level++) {
+		set_simd_level(level);
+		printf("%-8s %14.1f %14.1f %14.1f\n", levels[level],
+			bench_parse<0>(xml, buffer, iterations),
+			bench_parse<parse_non_destructive>(xml, buffer, iterations),
+			bench_parse<parse_fastest>(xml, buffer, iterations));
+	}
+	return 0;
+}
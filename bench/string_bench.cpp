@@ -0,0 +1,88 @@
+/**
+ * Microbenchmarks for unbuild's string building hot paths: parse_string(),
+ * build_compiler_string(), tokenize() and compile command assembly.
+ *
+ * Usage: string_bench
+ *
+ * Reports ns/op and allocations/op (counted by unbuild's operator new) for
+ * inputs sized like large generated projects.
+ */
+#define UNBUILD_NO_MAIN
+#include "../main.cpp"
+
+template<class F>
+void bench(const char* name, F f) {
+	//Warm up, then size the run to take roughly 200ms.
+	f();
+	int iterations = 1;
+	double ns = 0;
+	while (true) {
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) f();
+		ns = (double) chrono::duration_cast<chrono::nanoseconds>(
+			chrono::steady_clock::now() - start).count();
+		if (ns > 2e8 || iterations >= (1 << 24)) break;
+		iterations *= 2;
+	}
+	long long allocs = PROFILE.counters[COUNTER_ALLOCATIONS];
+	for (int i = 0; i < iterations; i++) f();
+	allocs = PROFILE.counters[COUNTER_ALLOCATIONS] - allocs;
+	printf("%-36s %12.1f %12.2f\n", name, ns / iterations, (double) allocs / iterations);
+}
+
+int main() {
+	COMPILER = COMPILER_GCC;
+	FLAGS.config = "release";
+	FLAGS.arch = "64";
+	FLAGS.profile = 1;
+	set_variant();
+
+	//Long include list.
+	string includes;
+	for (int i = 0; i < 60; i++)
+		includes += "third_party/library" + to_string(i) + "/include;";
+	//Flags with many $(...) macros.
+	string macros;
+	for (int i = 0; i < 40; i++)
+		macros += "L$(OUTPUT)$(SEP)lib" + to_string(i) + ";";
+	string plain;
+	for (int i = 0; i < 40; i++)
+		plain += "DDEFINE_" + to_string(i) + "=1;";
+	string exts = "c;cc;cpp;cxx;c++;m;mm;s;S;asm;h;hpp;hxx;inl;ipp;tcc;cu;ispc;def;rc";
+
+	//A source with a long include string and many ext-specific flag sets.
+	build_flags flags;
+	flags.compiler_flags = parse_string(build_compiler_string(plain.data(), plain.size()));
+	vector<string> ext_list;
+	tokenize(exts, ext_list, ";", true);
+	for (auto& ext : ext_list)
+		flags.ext_flags[ext] = "-fext-" + ext + " -Wext-" + ext + " ";
+	sourcefile file;
+	file.filename = "src/module/generated/very_long_generated_source_name_0042.cpp";
+	file.output = "output/gcc-64-release/src/module/generated/very_long_generated_source_name_0042.cpp.o";
+	file.includes = build_compiler_string(includes.data(), includes.size(), 'I', 1, 1, "../");
+	file.flags = &flags;
+
+	printf("%-36s %12s %12s\n", "benchmark", "ns/op", "allocs/op");
+	bench("parse_string (40 macros)", [&] {
+		string r = parse_string(macros);
+	});
+	bench("parse_string (no macros)", [&] {
+		string r = parse_string(plain);
+	});
+	bench("build_compiler_string (60 includes)", [&] {
+		string r = build_compiler_string(includes.data(), includes.size(), 'I', 1, 1, "../");
+	});
+	bench("build_compiler_string (40 defines)", [&] {
+		string r = build_compiler_string(plain.data(), plain.size(), 'D', 1);
+	});
+	bench("tokenize (20 extensions)", [&] {
+		vector<string> tokens;
+		tokenize(exts, tokens, ";", true);
+	});
+	string command;
+	bench("compile_command", [&] {
+		compile_command(&file, command);
+	});
+	return 0;
+}
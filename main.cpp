@@ -2,16 +2,35 @@
 #ifdef _MSC_VER
 #pragma warning(disable: 4996)
 #include <direct.h>
+#include <io.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <spawn.h>
+extern char** environ;
+#endif
+#ifdef __linux__
+#include <sched.h>
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <cstdlib>
+#include <cstdint>
 #include <cstring>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <new>
 #include <errno.h>
 #include "rapidxml.hpp"
 
@@ -21,6 +40,8 @@ using namespace rapidxml;
 #ifdef _MSC_VER
 #define getcwd _getcwd
 #define mkdir _mkdir
+#define popen _popen
+#define pclose _pclose
 #define stat _stat
 #define PLATFORM 0
 #else
@@ -31,8 +52,19 @@ using namespace rapidxml;
 #define DEFAULT_OUTPUT_SUFFIX ".o"
 #define OPERATION_LINK 0
 #define OPERATION_LIB 1
+#define OPERATION_SHARED 2
+#define PGO_GENERATE 1
+#define PGO_USE 2
 #define COMPILER_MSVC 0
 #define COMPILER_GCC 1
+//Project files at least this size are read with the streaming reader.
+#define STREAM_THRESHOLD (1024 * 1024)
+//Bytes in front of each parse arena block, keeps the pool aligned.
+#define ARENA_HEADER 16
+#define CACHE_MAGIC 0x31434255 //"UBC1"
+#define CACHE_VERSION 10
+//Memory assumed to be needed by a single compile job when sizing -j.
+#define DEFAULT_JOB_MEMORY (512LL * 1024 * 1024)
 
 static int COMPILER = -1;
 vector<string> COMPILER_BINS { "cl", "gcc" };
@@ -42,23 +74,52 @@ vector<string> OUTPUT_LIB { "lib", "ar r " };
 vector<string> OUTPUT_LINK_EXT { ".exe", "" };
 vector<string> OUTPUT_LINK_OUTPUT { "/OUT:", "-o " };
 vector<string> OUTPUT_LIB_EXT { ".lib", ".a" };
+vector<string> OUTPUT_SHARED { "link /DLL", "gcc -shared" };
+vector<string> OUTPUT_SHARED_EXT { ".dll", ".so" };
+vector<string> COMPILER_PIC { "", "-fPIC" };
+//Writes <object without .o>.d listing the headers a compile read.
+vector<string> COMPILER_DEPFILE { "", "-MMD" };
+//C++20 modules: compile flag naming the module mapper, and the P1689 scan
+//(gcc 14 or later) writing a dependency file.
+vector<string> COMPILER_MODULES { "", "-fmodules-ts -fmodule-mapper=" };
+vector<string> COMPILER_MODULE_SCAN { "", "-E -fdeps-format=p1689r5 -fdeps-file=" };
+//Compiles a module interface extension the compiler doesn't know (.cppm,
+//.mpp, and .ixx with gcc) as C++; gcc takes it as a linker input otherwise.
+vector<string> COMPILER_MODULE_UNIT { "/interface", "-x c++" };
+//Link-time optimisation: compile flag, link flag and the link flag naming
+//its incremental cache (gcc 15 or later).
+vector<string> COMPILER_LTO { "/GL", "-flto" };
+vector<string> OUTPUT_LTO { "/LTCG", "-flto" };
+vector<string> OUTPUT_LTO_CACHE { "/LTCG:INCREMENTAL /LTCGOUT:", "-flto-incremental=" };
+//Profile-guided optimisation (gcc only): instrumented and optimised objects.
+vector<string> COMPILER_PGO_GENERATE { "", "-fprofile-generate -fprofile-update=atomic" };
+vector<string> COMPILER_PGO_USE { "", "-fprofile-use -fprofile-partial-training -Wno-missing-profile" };
 vector<string> COMPILER_OUTPUT { "/Fo", "-o " };
 vector<string> COMPILERS { "msvc", "gcc" };
 vector<string> COMPILER_FLAG{ "/", "-" };
 vector<string> OUTPUT_NULL{ "nul", "/dev/null" };
-vector<string>* OPERATIONS[] = { &OUTPUT_LINK, &OUTPUT_LIB };
+vector<string>* OPERATIONS[] = { &OUTPUT_LINK, &OUTPUT_LIB, &OUTPUT_SHARED };
 const string STR_WIN = "win32";
 const string STR_LINUX = "linux";
 const string STR_APPLE = "osx";
 const string DEFAULT_OUTPUT_DIR = "output";
 const string STR_APP = "app";
 const string STR_STATIC = "static";
+const string STR_SHARED = "shared";
+const string STR_LTO_FULL = "full";
+const string STR_LTO_THIN = "thin";
+const string STR_MODULES_P1689 = "p1689";
+const string STR_MODULES_BUILTIN = "builtin";
 const string EMPTY_STR = "";
 const string PATH_SEP_WIN = "\\";
 const string PATH_SEP_LINUX = "/";
 const string COMMAND_SEP_WIN = "&&";
 const string COMMAND_SEP_LINUX = ";";
 const string DEFAULT_ARCH = "32";
+//Tree name of builds without -m: no arch flag reaches the compiler.
+const string NATIVE_ARCH = "native";
+const string DEFAULT_CONFIG = "default";
+const string CACHE_DIR = ".unbuild";
 
 #ifdef _WIN32
 #define CHECK_OS_STR STR_WIN
@@ -78,6 +139,8 @@ struct output {
 	string compiled_files;
 	string extra_files;
 	string output_name;
+	string lto; //"full", "thin" or empty.
+	int lto_cache = 0;
 };
 
 struct build_flags {
@@ -92,22 +155,334 @@ struct sourcefile {
 	string output;
 	string includes;
 	build_flags* flags = NULL;
+	string dep_flags; //Compile flags propagated from dependencies.
+	//Per project: command prefix for each extension, and whether any ext=
+	//key contains a '.' (so can't be found from the last extension).
+	unordered_map<string, string> prefixes;
+	int dotted_exts = 0;
+	int pic = 0; //Objects for a shared library.
+	int lto = 0; //Objects for link-time optimisation.
+	int pgo = 0; //PGO_GENERATE or PGO_USE objects.
+	string modules; //Module mapper of C++ sources, if modules are on.
+	string command;
+	unordered_set<string> dirs; //Object directories created for the project.
+};
+
+struct dependency {
+	string path;
+	int link = 0;
+	int include = 0;
+};
+
+/**
+ * command_step is a <prebuild> command or a <generate>d one. Steps that
+ * declare outputs are skipped while those are up to date with the inputs.
+ */
+struct command_step {
+	string command;
+	vector<string> inputs;
+	vector<string> outputs;
+};
+
+/**
+ * rule is a <rule> command template for <generate>. $(IN), $(NAME) and $(OUT)
+ * are left for each generate; other macros are expanded there too.
+ */
+struct rule {
+	string name;
+	string command;
+	string inputs;
+	string outputs;
+};
+
+struct project_source {
+	string filename;
+	int prebuilt = 0; //out= sources are already objects.
+};
+
+/**
+ * project_model is a project resolved for the current os, compiler, config
+ * and arch. It is read once from the project xml; build steps only use it.
+ */
+struct project_model {
+	vector<dependency> depends;
+	vector<command_step> prebuild;
+	vector<command_step> generate;
+	vector<rule> rules; //Only used while reading <generate>s.
+	vector<string> includes;
+	build_flags flags;
+	vector<string> usage_flags; //<flags propagate="true">: also compile dependents.
+	vector<string> usage_link_flags; //Link flags that also link dependents.
+	vector<project_source> sources;
+	string link_files;
+	int has_output = 0; //Set once the first <output> has been read.
+	string output_name;
+	string output_type;
+	string output_file;
+	string lto; //lto= of the output: "full", "thin" or empty.
+	int lto_cache = 0;
+	string pgo; //<pgo> training command; $(IN) is left for the program.
+	string modules; //<modules scan=>: "p1689" or "builtin", empty if off.
+	int gc = 0; //<gc/>: delete stale outputs after planning.
+};
+
+/**
+ * xml_slice is an unterminated (pointer, size) view into a project file.
+ */
+struct xml_slice {
+	const char* data;
+	size_t size;
+
+	xml_slice(const char* d = NULL, size_t s = 0) : data(d), size(s) {}
+	string str() const { return string(data, size); }
+};
+
+/**
+ * project_element is one child element of <project>: its name, attributes
+ * (name, value pairs) and text value. It is filled from the DOM or by the
+ * streaming reader, so read_element() serves both.
+ */
+struct project_element {
+	xml_slice name;
+	xml_slice value;
+	vector<xml_slice> attributes;
+	deque<string> decoded; //Values with entities, translated by decode().
+
+	const xml_slice* first_attribute(const char* attr) const;
+	bool is(const char* tag) const;
+	void decode();
+	void decode(xml_slice& slice);
+};
+
+struct mapped_file {
+	char* data = NULL;
+	size_t size = 0;
+	int mapped = 0;
 };
 
 struct flags {
 	int safemode = 0;
+	int verbose = 0;
+	int jobs = 0;
+	int stream = 0;
+	int profile = 0;
+	int scan = 0; //Find headers with the include scanner, not depfiles.
+	int gc = 0; //Sweep the output trees for stale objects.
 	string config;
 	string arch;
+	string variant; //<compiler>-<arch>-<config>
+	string output_dir; //output/<variant>
 };
 
 static flags FLAGS;
 
+/**
+ * build_variant is one config/arch combination to build. Several -c and -m
+ * switches build every combination of them in one run.
+ */
+struct build_variant {
+	string config;
+	string arch;
+};
+
+static vector<build_variant> VARIANTS;
+static size_t VARIANT = 0; //Index of the active variant.
+
+
+enum {
+	PHASE_LOAD = 0,
+	PHASE_CACHE,
+	PHASE_PARSE,
+	PHASE_FLAGS,
+	PHASE_INCLUDES,
+	PHASE_CHECK,
+	PHASE_COMMAND,
+	PHASE_SPAWN,
+	PHASE_WAIT,
+	PHASE_SCAN,
+	PHASE_COUNT
+};
+
+enum {
+	COUNTER_STAT = 0,
+	COUNTER_BYTES_READ,
+	COUNTER_SPAWNED,
+	COUNTER_ALLOCATIONS,
+	COUNTER_COUNT
+};
+
+const char* PHASE_NAMES[] = { "load_project", "load cache", "parse", "read flags",
+	"dependency usage", "up-to-date checks", "command assembly", "spawn", "wait", "include scan" };
+const char* COUNTER_NAMES[] = { "files stat'ed", "bytes read", "processes spawned",
+	"allocations" };
+
+/**
+ * profile holds the --profile timers and counters. They are updated from the
+ * job threads too, so all are atomic.
+ */
+struct profile {
+	atomic<long long> phase_ns[PHASE_COUNT];
+	atomic<long long> phase_calls[PHASE_COUNT];
+	atomic<long long> counters[COUNTER_COUNT];
+	chrono::steady_clock::time_point start;
+};
+
+static profile PROFILE;
+
+void count(int counter, long long amount = 1) {
+	PROFILE.counters[counter].fetch_add(amount, memory_order_relaxed);
+}
+
+/**
+ * phase_timer adds the time until it goes out of scope to a profile phase
+ * when --profile is set. Phases nest, so times are inclusive.
+ */
+struct phase_timer {
+	int phase;
+	chrono::steady_clock::time_point start;
+
+	phase_timer(int p) : phase(p) {
+		if (FLAGS.profile) start = chrono::steady_clock::now();
+	}
+
+	~phase_timer() {
+		if (!FLAGS.profile) return;
+		long long ns = (long long) chrono::duration_cast<chrono::nanoseconds>(
+			chrono::steady_clock::now() - start).count();
+		PROFILE.phase_ns[phase].fetch_add(ns, memory_order_relaxed);
+		PROFILE.phase_calls[phase].fetch_add(1, memory_order_relaxed);
+	}
+};
+
+/**
+ * @brief print_profile prints the --profile summary table.
+ */
+void print_profile() {
+	double total = chrono::duration_cast<chrono::microseconds>(
+		chrono::steady_clock::now() - PROFILE.start).count() / 1000.0;
+	printf("\nProfile (wall %.2f ms; phase times are inclusive, spawn/wait summed over jobs)\n", total);
+	printf("%-20s %10s %12s %12s\n", "phase", "calls", "total ms", "avg us");
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		long long calls = PROFILE.phase_calls[i];
+		double ms = PROFILE.phase_ns[i] / 1e6;
+		printf("%-20s %10lld %12.3f %12.2f\n", PHASE_NAMES[i], calls, ms,
+			calls ? ms * 1000 / calls : 0.0);
+	}
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		printf("%-20s %10lld\n", COUNTER_NAMES[i], (long long) PROFILE.counters[i]);
+}
+
+/**
+ * @brief stat_file is stat() counted for --profile.
+ */
+int stat_file(const char* path, struct stat* s) {
+	count(COUNTER_STAT);
+	return stat(path, s);
+}
+
+//The replacement deletes are kept out of line: inlined, gcc sees free() on
+//a pointer from operator new and warns (-Wmismatched-new-delete).
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+//Count allocations only under --profile, so normal builds pay no atomic.
+void* operator new(size_t size) {
+	if (FLAGS.profile) count(COUNTER_ALLOCATIONS);
+	void* p = malloc(size ? size : 1);
+	if (p == NULL) throw bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size) {
+	if (FLAGS.profile) count(COUNTER_ALLOCATIONS);
+	void* p = malloc(size ? size : 1);
+	if (p == NULL) throw bad_alloc();
+	return p;
+}
+
+NOINLINE void operator delete(void* p) noexcept {
+	free(p);
+}
+
+NOINLINE void operator delete[](void* p) noexcept {
+	free(p);
+}
+
+//The sized and aligned forms are replaced too, so every delete matches the
+//allocator of its new.
+NOINLINE void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+NOINLINE void operator delete[](void* p, size_t) noexcept {
+	free(p);
+}
+
+#ifdef __cpp_aligned_new
+//Over-aligned types (C++17). new[] doesn't forward to new, or gcc pairs
+//delete[] with operator new once inlined.
+void* aligned_new(size_t size, align_val_t align) {
+	if (FLAGS.profile) count(COUNTER_ALLOCATIONS);
+	size_t alignment = (size_t) align;
+	if (alignment < sizeof(void*)) alignment = sizeof(void*);
+	void* p = NULL;
+#ifdef _MSC_VER
+	p = _aligned_malloc(size ? size : 1, alignment);
+#else
+	if (posix_memalign(&p, alignment, size ? size : 1) != 0) p = NULL;
+#endif
+	if (p == NULL) throw bad_alloc();
+	return p;
+}
+
+void aligned_delete(void* p) noexcept {
+#ifdef _MSC_VER
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+void* operator new(size_t size, align_val_t align) {
+	return aligned_new(size, align);
+}
+
+void* operator new[](size_t size, align_val_t align) {
+	return aligned_new(size, align);
+}
+
+NOINLINE void operator delete(void* p, align_val_t) noexcept {
+	aligned_delete(p);
+}
+
+NOINLINE void operator delete[](void* p, align_val_t) noexcept {
+	aligned_delete(p);
+}
+
+NOINLINE void operator delete(void* p, size_t, align_val_t) noexcept {
+	aligned_delete(p);
+}
+
+NOINLINE void operator delete[](void* p, size_t, align_val_t) noexcept {
+	aligned_delete(p);
+}
+#endif
 
 enum {
 	FIRST = 1,
 	FACTOR = 2
 };
 
+enum {
+	LOAD_OK = 0,
+	LOAD_NO_PROJECT,
+	LOAD_OPEN_FAILED,
+	LOAD_PARSE_FAILED
+};
+
 char* pgetcwd(void) {
 	void *buf;
 	void *newbuf;
@@ -190,7 +565,7 @@ void tokenize(const std::string& str, T& tokens,
  */
 const string& macro_replace(const string& key) {
 	if (key == "OUTPUT") {
-		return (FLAGS.config.empty() ? DEFAULT_OUTPUT_DIR : FLAGS.config);
+		return FLAGS.output_dir;
 	}
 	else if (key == "SEP") {
 #ifdef _WIN32
@@ -215,6 +590,31 @@ const string& macro_replace(const string& key) {
 	else return EMPTY_STR;
 }
 
+/**
+ * @brief set_variant names the active compiler/arch/config combination and
+ * its intermediate/output tree, output/<compiler>-<arch>-<config>, so
+ * variants never share objects. Without -m the compiler builds for its own
+ * target, so the tree is <compiler>-native-<config>, apart from -m32's.
+ */
+void set_variant() {
+	FLAGS.variant = COMPILERS[COMPILER] + "-" +
+		(FLAGS.arch.empty() ? NATIVE_ARCH : FLAGS.arch) + "-" +
+		(FLAGS.config.empty() ? DEFAULT_CONFIG : FLAGS.config);
+	FLAGS.output_dir = DEFAULT_OUTPUT_DIR + PATH_SEP + FLAGS.variant;
+}
+
+/**
+ * @brief use_variant makes VARIANTS[index] the active variant; macros, flag
+ * filters and output paths all follow it.
+ * @param index the variant.
+ */
+void use_variant(size_t index) {
+	VARIANT = index;
+	FLAGS.config = VARIANTS[index].config;
+	FLAGS.arch = VARIANTS[index].arch;
+	set_variant();
+}
+
 /**
  * @brief parse_string identifies and replaces $() macros with the appropriate
  * value, returning the expanded form. No recursive macros, simple substituion
@@ -244,165 +644,771 @@ string parse_string(const string &src) {
 	return output;
 }
 
+/**
+ * @brief value_is compares an xml name/value slice with a string. Values are
+ * not zero-terminated as projects are parsed non-destructively.
+ * @param x the slice.
+ * @param str the string to compare against.
+ * @return true if x equals str.
+ */
+bool value_is(const xml_slice* x, const string& str) {
+	return x->size == str.size() &&
+		memcmp(x->data, str.data(), str.size()) == 0;
+}
+
+const xml_slice* project_element::first_attribute(const char* attr) const {
+	xml_slice key(attr, strlen(attr));
+	for (size_t i = 0; i + 1 < attributes.size(); i += 2) {
+		if (attributes[i].size == key.size &&
+			memcmp(attributes[i].data, key.data, key.size) == 0)
+			return &attributes[i + 1];
+	}
+	return NULL;
+}
+
+bool project_element::is(const char* tag) const {
+	return name.size == strlen(tag) && memcmp(name.data, tag, name.size) == 0;
+}
+
+/**
+ * @brief decode translates the entities of the element's value and attribute
+ * values: &lt; &gt; &amp; &quot; &apos; and character references (&#38;,
+ * &#x26;). Slices without a '&' keep pointing into the project file; only
+ * the others are copied.
+ */
+void project_element::decode() {
+	decoded.clear();
+	decode(value);
+	for (size_t i = 1; i < attributes.size(); i += 2) decode(attributes[i]);
+}
+
+void project_element::decode(xml_slice& slice) {
+	if (slice.size == 0 || memchr(slice.data, '&', slice.size) == NULL) return;
+	static const char* names[] = { "lt;", "gt;", "amp;", "quot;", "apos;" };
+	static const char chars[] = { '<', '>', '&', '"', '\'' };
+	decoded.push_back(string());
+	string& out = decoded.back();
+	out.reserve(slice.size);
+	const char* p = slice.data;
+	const char* end = slice.data + slice.size;
+	while (p < end) {
+		if (*p != '&') {
+			out += *p++;
+			continue;
+		}
+		const char* semi = (const char*) memchr(p, ';', end - p);
+		size_t length = semi == NULL ? 0 : semi - p + 1;
+		int found = 0;
+		for (int i = 0; !found && i < 5 && length > 0; i++) {
+			if (length == strlen(names[i]) + 1 && memcmp(p + 1, names[i], length - 1) == 0) {
+				out += chars[i];
+				found = 1;
+			}
+		}
+		if (!found && length > 3 && p[1] == '#') {
+			int hex = p[2] == 'x';
+			char* digits_end = NULL;
+			unsigned long code = strtoul(p + 2 + hex, &digits_end, hex ? 16 : 10);
+			if (digits_end == semi && digits_end != p + 2 + hex && code > 0 && code <= 0x10FFFF) {
+				//UTF-8.
+				if (code < 0x80) out += (char) code;
+				else if (code < 0x800) {
+					out += (char) (0xC0 | (code >> 6));
+					out += (char) (0x80 | (code & 0x3F));
+				}
+				else if (code < 0x10000) {
+					out += (char) (0xE0 | (code >> 12));
+					out += (char) (0x80 | ((code >> 6) & 0x3F));
+					out += (char) (0x80 | (code & 0x3F));
+				}
+				else {
+					out += (char) (0xF0 | (code >> 18));
+					out += (char) (0x80 | ((code >> 12) & 0x3F));
+					out += (char) (0x80 | ((code >> 6) & 0x3F));
+					out += (char) (0x80 | (code & 0x3F));
+				}
+				found = 1;
+			}
+		}
+		if (found) p += length;
+		else out += *p++; //Not an entity; kept as written.
+	}
+	slice = xml_slice(out.data(), out.size());
+}
+
 /**
  * @brief check_os compares the current host os with os= values
- * @param child the xml node containing the os attribute
+ * @param child the element containing the os attribute
  * @return 1 if the os attribute matches, 0 otherwise.
  */
-int check_os(xml_node<>* child) {
-	xml_attribute<>* os = child->first_attribute("os"); 
-	if (os != NULL) { 
-		string os_str = string(os->value(), os->value_size()); 
-		if (os_str != CHECK_OS_STR) 
-			return 0;
-	}
+int check_os(const project_element& child) {
+	const xml_slice* os = child.first_attribute("os"); 
+	if (os != NULL && !value_is(os, CHECK_OS_STR)) 
+		return 0;
 	return 1;
 }
 
 /**
- * @brief load_project opens the provided path, reading the project data
- * into a buffer.
+ * @brief load_project maps the provided path read-only. Files that end
+ * exactly on a page boundary have no zero byte after them in the mapping, so
+ * they (and platforms without mmap) are read into a terminated buffer instead.
  * @param path the project xml path.
- * @return the loaded file.
+ * @param file the loaded file, released with unload_project().
+ * @return 1 if the file was loaded, 0 otherwise.
  */
-char* load_project(const char* path) {
-	int sz = 0;
-	char* project_data = NULL;
+int load_project(const char* path, mapped_file& file) {
+	phase_timer timer(PHASE_LOAD);
+#ifndef _MSC_VER
+	int fd = open(path, O_RDONLY);
+	struct stat s;
+	if (fd < 0 || fstat(fd, &s) < 0) {
+		if (fd >= 0) close(fd);
+		fprintf(stderr, "Error: Could not open %s.\n", path);
+		return 0;
+	}
+	file.size = (size_t) s.st_size;
+	long page = sysconf(_SC_PAGESIZE);
+	if (file.size > 0 && file.size % page != 0) {
+		void* data = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			close(fd);
+			file.data = (char*) data;
+			file.mapped = 1;
+			count(COUNTER_BYTES_READ, file.size);
+			return 1;
+		}
+	}
+	file.data = new char[file.size + 1];
+	size_t total = 0;
+	while (total < file.size) {
+		ssize_t r = read(fd, file.data + total, file.size - total);
+		if (r <= 0) break;
+		total += r;
+	}
+	close(fd);
+#else
 	FILE* fp = NULL;
-	size_t read = 0;
-	if (!(fp = fopen(path, "r"))) {
+	if (!(fp = fopen(path, "rb"))) {
 		fprintf(stderr, "Error: Could not open %s.\n", path);
-		return NULL;
+		return 0;
 	}
-
 	fseek(fp, 0L, SEEK_END);
-	sz = ftell(fp);
+	file.size = (size_t) ftell(fp);
 	fseek(fp, 0, SEEK_SET);
-	project_data = new char[sz + 1];
-	read = fread(project_data, sizeof(char), sz, fp);
-	project_data[read] = '\0';
+	file.data = new char[file.size + 1];
+	size_t total = fread(file.data, sizeof(char), file.size, fp);
 	fclose(fp);
-	return project_data;
+#endif
+	file.data[total] = '\0';
+	file.size = total;
+	file.mapped = 0;
+	count(COUNTER_BYTES_READ, total);
+	return 1;
 }
 
-int run_command(const char* cmd) {
-	printf("%s\n", cmd);
-	if (!FLAGS.safemode) return system(cmd);
-	return 0;
+/**
+ * @brief unload_project releases a file loaded by load_project().
+ * @param file the loaded file.
+ */
+void unload_project(mapped_file& file) {
+#ifndef _MSC_VER
+	if (file.mapped) munmap(file.data, file.size);
+	else
+#endif
+	delete[] file.data;
+	file.data = NULL;
+	file.size = 0;
 }
 
-int compile_file(sourcefile* file) {
-	//Run the configured compiler.
-	string command;
-	string* filename = &file->filename;
-	int asm_win = 0;
-	if(COMPILER == COMPILER_MSVC && (endsWith(*filename, ".asm") || endsWith(*filename, ".s"))) {
-		command = "ml";
-		if(FLAGS.arch == "64") command += "64";
-		asm_win = 1;
-	} else {
-		command = COMPILER_BINS[COMPILER];
+/**
+ * parse_arena backs the memory pool of the single document every project is
+ * parsed into. Blocks released when the document is cleared are kept and
+ * handed out again for the next project instead of going back to the heap.
+ */
+struct parse_arena {
+	vector<char*> free_blocks;
+	size_t reserved = 0;
+	size_t in_use = 0;
+	size_t peak = 0;
+	int projects = 0;
+
+	~parse_arena() {
+		for (auto block : free_blocks) delete[] block;
 	}
-	const string sep = " ";
-	command += sep;	
-	command += COMPILER_OUTPUT[COMPILER] + file->output + sep;
-	command += COMPILER_NOLINK[COMPILER] + sep;
-	command += *filename + sep;
-	command += file->includes + sep;
-	
-	//Don't apply compilation flags to asm files under windows.
-	if (!asm_win) {
-		if(COMPILER == COMPILER_GCC && !FLAGS.arch.empty()) {
-			command += "-m" + FLAGS.arch + sep;
-		}
-		command += file->flags->compiler_flags + sep;
-		for(auto kv : file->flags->ext_flags) {
-			if(endsWith(*filename, "." + kv.first)) {
-				command += kv.second + sep;
-				break;
-			}
+};
+
+static parse_arena ARENA;
+
+/**
+ * @brief arena_alloc is the memory_pool allocation hook. Each block starts
+ * with its size so arena_free() can recycle it.
+ */
+void* arena_alloc(size_t size) {
+	char* block = NULL;
+	for (size_t i = 0; i < ARENA.free_blocks.size(); i++) {
+		if (*(size_t*) ARENA.free_blocks[i] >= size) {
+			block = ARENA.free_blocks[i];
+			ARENA.free_blocks.erase(ARENA.free_blocks.begin() + i);
+			break;
 		}
 	}
-	
-	printf("%s\n", command.c_str());
-	if(!FLAGS.safemode) return system(command.c_str());
-	return 0;
+	if (block == NULL) {
+		block = new char[ARENA_HEADER + size];
+		*(size_t*) block = size;
+		ARENA.reserved += size;
+	}
+	ARENA.in_use += *(size_t*) block;
+	if (ARENA.in_use > ARENA.peak) ARENA.peak = ARENA.in_use;
+	return block + ARENA_HEADER;
 }
 
-int produce_output(output& file, int operation, build_flags* f) {
-	string command_toolchain(OPERATIONS[operation]->at(COMPILER)); 
-#ifndef NO_RESPONSE_FILE
-	command_toolchain += " @link";
-#endif
-	string command;
-	const string sep = " ";
-	int error = 0;
-	if(operation == OPERATION_LINK || COMPILER == COMPILER_MSVC) {
-		command += file.compiled_files + sep;
-		command += file.extra_files + sep;
-		command += f->linker_flags + sep;
-		if(COMPILER == COMPILER_GCC && !FLAGS.arch.empty()) {
-			command += "-m" + FLAGS.arch + sep;
-		}
-		command += OUTPUT_LINK_OUTPUT[COMPILER];
-		command += file.output_name;
-	} else {
-		//LIB on linux == ar. 
-		command += file.output_name;
-		command += sep + file.compiled_files + sep;
-		command += file.extra_files + sep;
-	}
-#ifndef NO_RESPONSE_FILE
-	FILE* tmp = fopen("link", "w");
-	fwrite(command.c_str(), sizeof(char), command.size(), tmp);
-	fclose(tmp);
-#endif
-	
-	printf("%s\n", command.c_str());
-	if (!FLAGS.safemode) {
-#ifndef NO_RESPONSE_FILE
-		error = system(command_toolchain.c_str());
-		unlink("link");
-#else
-		system((command_toolchain + sep + command).c_str());
-#endif
+/**
+ * @brief arena_free is the memory_pool free hook; the block is kept for reuse.
+ */
+void arena_free(void* memory) {
+	char* block = (char*) memory - ARENA_HEADER;
+	ARENA.in_use -= *(size_t*) block;
+	ARENA.free_blocks.push_back(block);
+}
+
+/**
+ * @brief parse_document returns the heap allocated document shared by all
+ * project loads in this invocation.
+ */
+xml_document<>& parse_document() {
+	static xml_document<>* doc = NULL;
+	if (doc == NULL) {
+		doc = new xml_document<>();
+		doc->set_allocator(arena_alloc, arena_free);
+		ARENA.reserved += sizeof(xml_document<>);
 	}
-	return 0;
+	return *doc;
+}
 
+/**
+ * @brief parse_project parses a loaded project without modifying it; names
+ * and values are (pointer, size) slices into the file. The document must be
+ * cleared before the file is unloaded.
+ * @param doc the document to parse into.
+ * @param file the loaded project file.
+ */
+void parse_project(xml_document<>& doc, mapped_file& file) {
+	phase_timer timer(PHASE_PARSE);
+	ARENA.projects++;
+	doc.parse<parse_non_destructive>(file.data);
 }
 
-string get_output_file(xml_node<>* output) {
-	string output_str = FLAGS.config.empty() ? DEFAULT_OUTPUT_DIR : FLAGS.config;
-	if (output != NULL) {
-		string output_name(output->value(), output->value_size());
-		xml_attribute<>* output_type = output->first_attribute("type");
+/**
+ * @brief read_first_line reads the first line of a small (proc/sysfs) file.
+ * @param path the file to read.
+ * @param line the output line, without the trailing newline.
+ * @return 1 if the file could be read, 0 otherwise.
+ */
+int read_first_line(const string& path, string& line) {
+	FILE* fp = fopen(path.c_str(), "r");
+	if (fp == NULL) return 0;
+	char buf[512];
+	int ok = fgets(buf, sizeof(buf), fp) != NULL;
+	fclose(fp);
+	if (!ok) return 0;
+	line = buf;
+	while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+		line.pop_back();
+	return 1;
+}
 
-		if (output_type != NULL) {
-			string outval = string(output_type->value(), output_type->value_size());
-			if (outval == STR_APP) {
-				output_str += PATH_SEP + output_name + OUTPUT_LINK_EXT[COMPILER];
-			}
-			else if (outval == STR_STATIC) {
-				output_str += PATH_SEP + output_name + OUTPUT_LIB_EXT[COMPILER];
+/**
+ * @brief cgroup_dirs lists the cgroup directories that apply to this process
+ * for a controller, from the process' own group up to the hierarchy root.
+ * Limits set on any ancestor apply too, so callers take the minimum.
+ * @param controller the v1 controller name, or "" for the unified (v2) hierarchy.
+ * @return the candidate directories, most specific first.
+ */
+vector<string> cgroup_dirs(const string& controller) {
+	vector<string> dirs;
+#ifdef __linux__
+	vector<string> mounts;
+	string line;
+	if (controller.empty()) {
+		if (read_first_line("/sys/fs/cgroup/cgroup.controllers", line))
+			mounts.push_back("/sys/fs/cgroup");
+		else
+			mounts.push_back("/sys/fs/cgroup/unified");
+	}
+	else {
+		mounts.push_back("/sys/fs/cgroup/" + controller);
+		//cpu is often co-mounted with cpuacct.
+		if (controller == "cpu") {
+			mounts.push_back("/sys/fs/cgroup/cpu,cpuacct");
+			mounts.push_back("/sys/fs/cgroup/cpuacct,cpu");
+		}
+	}
+
+	//Find this process' group: "id:controllers:path" (v2 is "0::path").
+	string group;
+	FILE* fp = fopen("/proc/self/cgroup", "r");
+	if (fp != NULL) {
+		char buf[1024];
+		while (fgets(buf, sizeof(buf), fp) != NULL) {
+			vector<string> fields;
+			string entry(buf);
+			while (!entry.empty() && entry.back() == '\n') entry.pop_back();
+			tokenize(entry, fields, ":");
+			if (fields.size() < 3) continue;
+			vector<string> controllers;
+			tokenize(fields[1], controllers, ",", true);
+			bool match = controller.empty() ? (fields[0] == "0" && fields[1].empty()) : false;
+			for (auto& c : controllers)
+				if (c == controller) match = true;
+			if (match) {
+				group = fields[2];
+				break;
 			}
 		}
+		fclose(fp);
 	}
-	return output_str;
-}
 
-string make_output_filename(string& immdir, string& filename) {
-	size_t spos = filename.find_last_of('/');
-	if (spos == string::npos) spos = 0;
-	else spos++;
-	return immdir + PATH_SEP + filename.substr(spos, filename.find_last_of('.')) + DEFAULT_OUTPUT_SUFFIX;
+	for (auto& mount : mounts) {
+		string path = group;
+		while (!path.empty() && path != "/") {
+			dirs.push_back(mount + path);
+			size_t pos = path.find_last_of('/');
+			path = path.substr(0, pos);
+		}
+		dirs.push_back(mount);
+	}
+#endif
+	return dirs;
 }
 
-string build_compiler_string(xml_node<>* node, char prefix='\0', int escape=0, int useflag=1, const string& s_prefix="") {
-	size_t pos = 0;
-	size_t size = node->value_size();
-	char* v = node->value();
-	string built;
-	for (size_t i = 0; i < size; i++) {
+/**
+ * @brief cgroup_cpu_quota reads the cgroup v2 cpu.max or v1 cfs quota.
+ * @return the number of cpus the quota allows, or 0 if unlimited/unknown.
+ */
+double cgroup_cpu_quota() {
+	double quota = 0;
+	string line;
+	for (auto& dir : cgroup_dirs("")) {
+		//cpu.max: "$MAX $PERIOD" where $MAX may be "max".
+		if (read_first_line(dir + "/cpu.max", line)) {
+			vector<string> fields;
+			tokenize(line, fields, " ", true);
+			if (fields.size() == 2 && fields[0] != "max") {
+				double q = atof(fields[0].c_str()) / atof(fields[1].c_str());
+				if (q > 0 && (quota == 0 || q < quota)) quota = q;
+			}
+		}
+	}
+	for (auto& dir : cgroup_dirs("cpu")) {
+		string period;
+		if (read_first_line(dir + "/cpu.cfs_quota_us", line) &&
+			read_first_line(dir + "/cpu.cfs_period_us", period)) {
+			double us = atof(line.c_str());
+			if (us > 0) {
+				double q = us / atof(period.c_str());
+				if (q > 0 && (quota == 0 || q < quota)) quota = q;
+			}
+		}
+	}
+	return quota;
+}
+
+/**
+ * @brief cgroup_memory_limit reads the cgroup v2 memory.max or v1 limit.
+ * @return the memory limit in bytes, or 0 if unlimited/unknown.
+ */
+long long cgroup_memory_limit() {
+	long long limit = 0;
+	string line;
+	vector<string> files;
+	for (auto& dir : cgroup_dirs(""))
+		files.push_back(dir + "/memory.max");
+	for (auto& dir : cgroup_dirs("memory"))
+		files.push_back(dir + "/memory.limit_in_bytes");
+	for (auto& file : files) {
+		if (!read_first_line(file, line) || line == "max") continue;
+		long long l = atoll(line.c_str());
+		//v1 reports "unlimited" as a huge page-aligned value.
+		if (l <= 0 || l >= (1LL << 62)) continue;
+		if (limit == 0 || l < limit) limit = l;
+	}
+	return limit;
+}
+
+/**
+ * @brief detect_jobs determines the default number of parallel jobs from the
+ * cpus this process may run on (affinity mask), any cgroup cpu quota and the
+ * cgroup memory limit.
+ * @return the number of jobs to run, at least 1.
+ */
+int detect_jobs() {
+	int cpus = (int) thread::hardware_concurrency();
+#ifdef __linux__
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		cpus = CPU_COUNT(&set);
+#endif
+	if (cpus < 1) cpus = 1;
+
+	int jobs = cpus;
+	double quota = cgroup_cpu_quota();
+	if (quota > 0 && quota < jobs) {
+		jobs = (int) quota;
+		if (jobs < quota) jobs++; //Round partial cpus up.
+	}
+
+	long long memory = cgroup_memory_limit();
+	if (memory > 0 && memory / DEFAULT_JOB_MEMORY < jobs)
+		jobs = (int) (memory / DEFAULT_JOB_MEMORY);
+	if (jobs < 1) jobs = 1;
+
+	if (FLAGS.verbose) {
+		printf("Detected %d cpus (affinity), cpu quota: ", cpus);
+		if (quota > 0) printf("%.2f", quota);
+		else printf("none");
+		printf(", memory limit: ");
+		if (memory > 0) printf("%lld MB", memory / (1024 * 1024));
+		else printf("none");
+		printf(". Using %d jobs.\n", jobs);
+	}
+	return jobs;
+}
+
+/**
+ * @brief run_process runs a shell command in a directory and waits for it,
+ * timing the spawn and the wait separately for --profile.
+ * @param command the command line.
+ * @param cwd the directory to run it in, empty for the current directory.
+ * @return 0 if the command succeeded, its (non-zero) status otherwise.
+ */
+int run_process(const string& command, const string& cwd) {
+	count(COUNTER_SPAWNED);
+	//Jobs run concurrently for several projects, so change directory in the
+	//child's shell rather than in this process.
+	string line;
+	if (!cwd.empty()) {
+#ifdef _WIN32
+		line = "cd /d \"" + cwd + "\" && ";
+#else
+		line = "cd '";
+		for (char c : cwd) {
+			if (c == '\'') line += "'\\''";
+			else line += c;
+		}
+		line += "' && ";
+#endif
+	}
+	line += command;
+#ifndef _MSC_VER
+	pid_t pid;
+	int result;
+	{
+		phase_timer timer(PHASE_SPAWN);
+		const char* argv[] = { "sh", "-c", line.c_str(), NULL };
+		result = posix_spawn(&pid, "/bin/sh", NULL, NULL, (char* const*) argv, environ);
+	}
+	if (result != 0) return result;
+	phase_timer timer(PHASE_WAIT);
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) return 1;
+	}
+	return status;
+#else
+	phase_timer timer(PHASE_SPAWN);
+	return system(line.c_str());
+#endif
+}
+
+/**
+ * @brief is_module_unit tells whether a source has a module interface
+ * extension that needs COMPILER_MODULE_UNIT. MSVC knows .ixx itself.
+ */
+int is_module_unit(const string& filename) {
+	if (endsWith(filename, ".cppm") || endsWith(filename, ".mpp")) return 1;
+	return COMPILER == COMPILER_GCC && endsWith(filename, ".ixx");
+}
+
+/**
+ * @brief is_cxx_source tells whether a source is C++ (so may be a module unit).
+ */
+int is_cxx_source(const string& filename) {
+	static const char* exts[] = { ".cpp", ".cc", ".cxx", ".c++", ".C" };
+	for (const char* ext : exts)
+		if (endsWith(filename, ext)) return 1;
+	return is_module_unit(filename);
+}
+
+/**
+ * @brief command_prefix returns the invariant part of the compile command for
+ * sources like file->filename: compiler, includes, arch and flags, including
+ * any ext= flags. Prefixes are built once per project and extension.
+ * @param file the source file, its includes and flags.
+ * @return the command prefix, ending with a separator.
+ */
+const string& command_prefix(sourcefile* file) {
+	const string& filename = file->filename;
+	size_t dot = filename.find_last_of("./");
+	string key;
+	if (dot != string::npos && filename[dot] == '.') key.assign(filename, dot + 1, string::npos);
+	if (file->dotted_exts) {
+		//ext="pb.cc" style keys can't be told apart by the last extension.
+		for (auto& kv : file->flags->ext_flags) {
+			if (kv.first.size() < filename.size() &&
+				filename[filename.size() - kv.first.size() - 1] == '.' && endsWith(filename, kv.first)) {
+				key = kv.first;
+				break;
+			}
+		}
+	}
+	auto it = file->prefixes.find(key);
+	if (it != file->prefixes.end()) return it->second;
+
+	string command;
+	int asm_win = 0;
+	if(COMPILER == COMPILER_MSVC && (key == "asm" || key == "s")) {
+		command = "ml";
+		if(FLAGS.arch == "64") command += "64";
+		asm_win = 1;
+	} else {
+		command = COMPILER_BINS[COMPILER];
+	}
+	const string sep = " ";
+	command += sep;	
+	command += COMPILER_NOLINK[COMPILER] + sep;
+	command += file->includes + sep;
+	
+	//Don't apply compilation flags to asm files under windows.
+	if (!asm_win) {
+		if(COMPILER == COMPILER_GCC && !FLAGS.arch.empty()) {
+			command += "-m" + FLAGS.arch + sep;
+		}
+		if (!FLAGS.scan && !COMPILER_DEPFILE[COMPILER].empty()) {
+			command += COMPILER_DEPFILE[COMPILER] + sep;
+		}
+		if (file->pic && !COMPILER_PIC[COMPILER].empty()) {
+			command += COMPILER_PIC[COMPILER] + sep;
+		}
+		if (file->lto) {
+			command += COMPILER_LTO[COMPILER] + sep;
+		}
+		if (!file->modules.empty() && is_cxx_source(filename)) {
+			command += COMPILER_MODULES[COMPILER] + file->modules + sep;
+		}
+		if (file->pgo == PGO_GENERATE) {
+			command += COMPILER_PGO_GENERATE[COMPILER] + sep;
+		}
+		else if (file->pgo == PGO_USE) {
+			command += COMPILER_PGO_USE[COMPILER] + sep;
+		}
+		command += file->dep_flags + sep;
+		command += file->flags->compiler_flags + sep;
+		auto ext = file->flags->ext_flags.find(key);
+		if (ext != file->flags->ext_flags.end())
+			command += ext->second + sep;
+		//Last, as gcc's -x applies to the files after it.
+		if (is_module_unit(filename)) {
+			command += COMPILER_MODULE_UNIT[COMPILER] + sep;
+		}
+	}
+	return file->prefixes[key] = command;
+}
+
+/**
+ * @brief compile_command assembles the compiler command line for a source
+ * from its extension's prefix, reusing the command buffer.
+ * @param file the source file, its output and flags.
+ * @param command the command line, overwritten.
+ */
+void compile_command(sourcefile* file, string& command) {
+	phase_timer timer(PHASE_COMMAND);
+	const string& prefix = command_prefix(file);
+	command.clear();
+	command.reserve(prefix.size() + COMPILER_OUTPUT[COMPILER].size() +
+		file->output.size() + file->filename.size() + 1);
+	command += prefix;
+	command += COMPILER_OUTPUT[COMPILER];
+	command += file->output;
+	command += ' ';
+	command += file->filename;
+}
+
+/**
+ * @brief lto_link_flags returns the link flags for an output's link-time
+ * optimisation. gcc's thin mode optimises partitions in parallel with the job
+ * count; full optimises the program as one partition.
+ * @param file the output.
+ */
+string lto_link_flags(const output& file) {
+	string flags = OUTPUT_LTO[COMPILER];
+	if (COMPILER == COMPILER_GCC) {
+		if (file.lto == STR_LTO_THIN) flags += "=" + to_string(FLAGS.jobs > 0 ? FLAGS.jobs : 1);
+		else flags += " -flto-partition=one";
+	}
+	if (file.lto_cache) {
+		//Kept with the variant's objects: output/<variant>/lto-cache.
+		string cache = FLAGS.output_dir + PATH_SEP "lto-cache";
+		if (COMPILER == COMPILER_MSVC) {
+			size_t slash = file.output_name.find_last_of('/');
+			cache += PATH_SEP + file.output_name.substr(slash == string::npos ? 0 : slash + 1) + ".iobj";
+		}
+		flags += " " + OUTPUT_LTO_CACHE[COMPILER] + cache;
+	}
+	return flags;
+}
+
+/**
+ * @brief link_command assembles the link (or lib) command line for an output;
+ * this is what goes into its response file.
+ * @param file the objects, extra files and name of the output.
+ * @param operation OPERATION_LINK, OPERATION_LIB or OPERATION_SHARED.
+ * @param f the project's flags.
+ * @param command the command line, overwritten.
+ */
+void link_command(output& file, int operation, build_flags* f, string& command) {
+	phase_timer timer(PHASE_COMMAND);
+	const string sep = " ";
+	command.clear();
+	if(operation != OPERATION_LIB || COMPILER == COMPILER_MSVC) {
+		command += file.compiled_files + sep;
+		command += file.extra_files + sep;
+		command += f->linker_flags + sep;
+		if(COMPILER == COMPILER_GCC && !FLAGS.arch.empty()) {
+			command += "-m" + FLAGS.arch + sep;
+		}
+		if (!file.lto.empty() && operation != OPERATION_LIB) {
+			command += lto_link_flags(file) + sep;
+		}
+		if(COMPILER == COMPILER_GCC && operation == OPERATION_SHARED) {
+			//Dependents record the file name, found through their rpath.
+			size_t slash = file.output_name.find_last_of('/');
+			string soname = file.output_name.substr(slash == string::npos ? 0 : slash + 1);
+#ifdef __APPLE__
+			command += "-Wl,-install_name,@rpath/" + soname + sep;
+#else
+			command += "-Wl,-soname," + soname + sep;
+#endif
+		}
+		command += OUTPUT_LINK_OUTPUT[COMPILER];
+		command += file.output_name;
+	} else {
+		//LIB on linux == ar. 
+		command += file.output_name;
+		command += sep + file.compiled_files + sep;
+		command += file.extra_files + sep;
+	}
+}
+
+string get_output_file(const string& output_name, const string& output_type) {
+	string output_str = FLAGS.output_dir;
+	if (output_type == STR_APP) {
+		output_str += PATH_SEP + output_name + OUTPUT_LINK_EXT[COMPILER];
+	}
+	else if (output_type == STR_STATIC) {
+		output_str += PATH_SEP + output_name + OUTPUT_LIB_EXT[COMPILER];
+	}
+	else if (output_type == STR_SHARED) {
+		output_str += PATH_SEP + output_name + OUTPUT_SHARED_EXT[COMPILER];
+	}
+	return output_str;
+}
+
+/**
+ * @brief dir_name returns the directory part of a path, "." if it has none.
+ */
+string dir_name(const string& path) {
+	size_t slash = path.find_last_of('/');
+	return slash == string::npos ? "." : path.substr(0, slash);
+}
+
+/**
+ * @brief profile_filename returns the gcc profile (.gcda) of an object:
+ * src/a.cpp.o has src/a.cpp.gcda.
+ */
+string profile_filename(const string& object) {
+	return object.substr(0, object.size() - strlen(DEFAULT_OUTPUT_SUFFIX)) + ".gcda";
+}
+
+/**
+ * @brief depfile_filename returns the depfile gcc -MMD writes for an object:
+ * src/a.cpp.o has src/a.cpp.d.
+ */
+string depfile_filename(const string& object) {
+	return object.substr(0, object.size() - strlen(DEFAULT_OUTPUT_SUFFIX)) + ".d";
+}
+
+/**
+ * @brief make_output_filename maps a source to its object in the intermediate
+ * directory, mirroring the source's relative directory and keeping its
+ * extension, so src/net/util.cpp and src/db/util.c get distinct objects.
+ * "." components are dropped. Components that can't be mirrored get reserved
+ * names starting with '_': ".." becomes "_up", an absolute path starts with
+ * "_abs", a source generated into the variant's tree ($(OUTPUT)/...) starts
+ * with "_out" and, on Windows, a drive letter C: with "_C". A real component starting with '_'
+ * gets another one ("__x" for "_x"), and ':' and '%' are written as %3A and
+ * %25, so no two sources map to the same object.
+ * @param immdir the intermediate directory.
+ * @param filename the source file.
+ * @return the object file path.
+ */
+string make_output_filename(const string& immdir, const string& filename) {
+	string output = immdir;
+	size_t start = 0;
+	if (!filename.empty() && (filename[0] == '/' || filename[0] == '\\')) {
+		output += PATH_SEP "_abs";
+	}
+	else if (filename.size() > FLAGS.output_dir.size() && filename[FLAGS.output_dir.size()] == '/' &&
+		filename.compare(0, FLAGS.output_dir.size(), FLAGS.output_dir) == 0) {
+		output += PATH_SEP "_out";
+		start = FLAGS.output_dir.size() + 1;
+	}
+#ifdef _WIN32
+	else if (filename.size() >= 2 && filename[1] == ':' && isalpha((unsigned char) filename[0])) {
+		output += PATH_SEP "_";
+		output += filename[0];
+		start = 2;
+	}
+#endif
+	while (start < filename.size()) {
+		size_t end = filename.find_first_of("/\\", start);
+		if (end == string::npos) end = filename.size();
+		size_t length = end - start;
+		if (length == 2 && filename.compare(start, 2, "..") == 0) {
+			output += PATH_SEP "_up";
+		}
+		else if (length > 0 && !(length == 1 && filename[start] == '.')) {
+			output += PATH_SEP;
+			if (filename[start] == '_') output += '_';
+			for (size_t i = start; i < end; i++) {
+				if (filename[i] == ':') output += "%3A";
+				else if (filename[i] == '%') output += "%25";
+				else output += filename[i];
+			}
+		}
+		start = end + 1;
+	}
+	return output + DEFAULT_OUTPUT_SUFFIX;
+}
+
+/**
+ * @brief make_dirs creates the directory holding path and its parents. Each
+ * directory is only created once per project.
+ * @param created the directories already created for this project.
+ * @param path the file whose directory is needed.
+ */
+void make_dirs(unordered_set<string>& created, const string& path) {
+	size_t pos = path.find_last_of('/');
+	if (pos == string::npos || pos == 0) return;
+	string dir = path.substr(0, pos);
+	if (!created.insert(dir).second) return;
+	make_dirs(created, dir);
+	mkdir(dir.c_str());
+}
+
+string build_compiler_string(const char* v, size_t size, char prefix='\0', int escape=0, int useflag=1, const string& s_prefix="") {
+	size_t pos = 0;
+	string built;
+	for (size_t i = 0; i < size; i++) {
 		char c = *(v + i);
 		if (i == size - 1) {
 			c = ';';
@@ -413,7 +1419,7 @@ string build_compiler_string(xml_node<>* node, char prefix='\0', int escape=0, i
 				if (useflag) built += COMPILER_FLAG[COMPILER];
 				if (prefix != '\0') built += prefix;
 				built += (escape ? "\"" : "") + s_prefix + 
-					string(node->value() + pos, i - pos) + 
+					string(v + pos, i - pos) + 
 					(escape ? "\" " : " ");
 				pos = i + 1;
 			}
@@ -422,337 +1428,2618 @@ string build_compiler_string(xml_node<>* node, char prefix='\0', int escape=0, i
 			}
 		}
 	}
-	return built;
+	return built;
+}
+
+int check_compiler_str(const char* str, size_t size) {
+	for (unsigned int i = 0; i < COMPILERS.size(); i++) {
+		if (COMPILERS.at(i).compare(0, string::npos, str, size) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int check_compiler_str(const char* str) {
+	return check_compiler_str(str, strlen(str));
+}
+
+void add_flags(build_flags& flags, const project_element& child, char prefix, int quote) {
+	string* target_flags = &flags.compiler_flags;
+	const xml_slice* step = child.first_attribute("step");
+	
+	if (step != NULL && value_is(step, "link")) 
+		target_flags = &flags.linker_flags;
+	
+	string flag_str = parse_string(build_compiler_string(child.value.data, child.value.size, prefix, quote));
+	const xml_slice* ext = child.first_attribute("ext");
+	if(ext != NULL) {
+		vector<string> exts;
+		tokenize(ext->str(), exts, ";", true);
+		for(auto& ext: exts) {
+			//Combine any existing flags for this extension.
+			flags.ext_flags[ext] += flag_str;
+		}
+		
+	} else 
+		*target_flags += flag_str;
+}
+
+void read_flags(const project_element& child, build_flags& flags) {
+	phase_timer timer(PHASE_FLAGS);
+	const xml_slice* compiler = child.first_attribute("compiler");
+	const xml_slice* config = child.first_attribute("config");
+	
+	if (config != NULL) {
+		if (!value_is(config, FLAGS.config)) {
+			return; //Not matching config, ignore flags.
+		}
+	}
+	
+	if(!check_os(child)) return;
+
+	const xml_slice* type = child.first_attribute("type");
+	char prefix = '\0';
+	int quote = 0;
+	if (type != NULL) {
+		if (type->size >= 2 && strncmp(type->data, "pp", 2) == 0) {
+			//Preprocessor flags.
+			prefix = 'D';
+			quote = 1;
+		}
+	}
+
+	if (compiler != NULL) {
+		//Compiler specific flags.
+		int target_compiler = check_compiler_str(compiler->data, compiler->size);
+		if (target_compiler != COMPILER) {
+			return;
+		}
+	}
+	
+	//All checks passed. Add the flag.
+	add_flags(flags, child, prefix, quote);
+}
+
+/**
+ * @brief rule_replace expands the $(IN), $(NAME) and $(OUT) macros of a rule
+ * template, then the other macros with parse_string().
+ */
+string rule_replace(const string& src, const string& in, const string& name, const string& out) {
+	string output;
+	for (size_t i = 0; i < src.size(); i++) {
+		if (src.compare(i, 5, "$(IN)") == 0) {
+			output += in;
+			i += 4;
+		}
+		else if (src.compare(i, 7, "$(NAME)") == 0) {
+			output += name;
+			i += 6;
+		}
+		else if (src.compare(i, 6, "$(OUT)") == 0) {
+			output += out;
+			i += 5;
+		}
+		else output += src[i];
+	}
+	return parse_string(output);
+}
+
+/**
+ * @brief generate_step applies a rule to one input file.
+ * @param r the rule.
+ * @param in the input file.
+ * @return the command, with the input and the rule's inputs and outputs.
+ */
+command_step generate_step(const rule& r, const string& in) {
+	command_step step;
+	//$(NAME) is the input's file name without directory or extension.
+	size_t slash = in.find_last_of('/');
+	string name = slash == string::npos ? in : in.substr(slash + 1);
+	size_t dot = name.find_last_of('.');
+	if (dot != string::npos && dot > 0) name.erase(dot);
+
+	tokenize(rule_replace(r.outputs, in, name, EMPTY_STR), step.outputs, ";", true);
+	string out;
+	for (auto& output : step.outputs) out += (out.empty() ? "" : " ") + output;
+	step.inputs.push_back(in);
+	tokenize(rule_replace(r.inputs, in, name, out), step.inputs, ";", true);
+	step.command = rule_replace(r.command, in, name, out);
+	return step;
+}
+
+/**
+ * @brief read_element resolves one child element of <project> into the
+ * project_model, applying os/config/arch/compiler filters and expanding $()
+ * macros, so the build steps never look at the xml.
+ * @param child the element.
+ * @param model the model to fill.
+ */
+void read_element(project_element& child, project_model& model) {
+	//Both readers leave the file untranslated; entities are decoded here.
+	child.decode();
+	if (child.is("depends")) {
+		if(!check_os(child))
+			return;
+		dependency dep;
+		dep.path = child.value.str();
+		const xml_slice* link = child.first_attribute("link");
+		dep.link = link != NULL && value_is(link, "true");
+		const xml_slice* include = child.first_attribute("include");
+		dep.include = include != NULL && value_is(include, "true");
+		model.depends.push_back(dep);
+	}
+	else if (child.is("prebuild")) {
+		if(!check_os(child))
+			return;
+		command_step step;
+		step.command = parse_string(child.value.str());
+		//inputs="a.idl;b.idl" outputs="$(OUTPUT)/gen/a.h"
+		const xml_slice* attr;
+		if ((attr = child.first_attribute("inputs")) != NULL)
+			tokenize(parse_string(attr->str()), step.inputs, ";", true);
+		if ((attr = child.first_attribute("outputs")) != NULL)
+			tokenize(parse_string(attr->str()), step.outputs, ";", true);
+		model.prebuild.push_back(step);
+	}
+	else if (child.is("rule")) {
+		if(!check_os(child))
+			return;
+		const xml_slice* name = child.first_attribute("name");
+		if (name == NULL) return;
+		rule r;
+		r.name = name->str();
+		r.command = child.value.str();
+		const xml_slice* attr;
+		if ((attr = child.first_attribute("inputs")) != NULL) r.inputs = attr->str();
+		if ((attr = child.first_attribute("outputs")) != NULL) r.outputs = attr->str();
+		model.rules.push_back(r);
+	}
+	else if (child.is("generate")) {
+		if(!check_os(child))
+			return;
+		const xml_slice* name = child.first_attribute("rule");
+		if (name == NULL) return;
+		for (auto& r : model.rules) {
+			if (value_is(name, r.name)) {
+				model.generate.push_back(generate_step(r, child.value.str()));
+				return;
+			}
+		}
+		fprintf(stderr, "Warning: No <rule> named %s before <generate>%s.\n",
+			name->str().c_str(), child.value.str().c_str());
+	}
+	else if (child.is("modules")) {
+		if(!check_os(child))
+			return;
+		const xml_slice* scan = child.first_attribute("scan");
+		if (scan == NULL || value_is(scan, STR_MODULES_P1689)) model.modules = STR_MODULES_P1689;
+		else if (value_is(scan, STR_MODULES_BUILTIN)) model.modules = STR_MODULES_BUILTIN;
+		else fprintf(stderr, "Warning: Unknown <modules scan=\"%s\">, expected p1689 or builtin.\n",
+			scan->str().c_str());
+	}
+	else if (child.is("gc")) {
+		if(!check_os(child))
+			return;
+		model.gc = 1;
+	}
+	else if (child.is("pgo")) {
+		if(!check_os(child))
+			return;
+		const xml_slice* config = child.first_attribute("config");
+		if (config != NULL && !value_is(config, FLAGS.config))
+			return;
+		model.pgo = child.value.str();
+	}
+	else if (child.is("include")) {
+		if(!check_os(child))
+			return;
+		model.includes.push_back(child.value.str());
+	}
+	else if (child.is("flags")) {
+		read_flags(child, model.flags);
+		const xml_slice* propagate = child.first_attribute("propagate");
+		if (propagate != NULL && value_is(propagate, "true")) {
+			build_flags usage;
+			read_flags(child, usage);
+			if (!usage.ext_flags.empty())
+				fprintf(stderr, "Warning: <flags ext=> are not propagated to dependents.\n");
+			if (!usage.compiler_flags.empty()) model.usage_flags.push_back(usage.compiler_flags);
+			if (!usage.linker_flags.empty()) model.usage_link_flags.push_back(usage.linker_flags);
+		}
+	}
+	else if (child.is("source")) {
+		const xml_slice* f = child.first_attribute("f");
+		project_source source;
+		//Expanded like <generate> outputs, so a source can be generated into
+		//the variant's tree as $(OUTPUT)/...
+		source.filename = parse_string(f != NULL ? f->str() : child.value.str());
+
+		if (source.filename.size() == 0) {
+			return;
+		}
+		
+		if(!check_os(child))
+			return;
+		
+		const xml_slice* arch = child.first_attribute("arch");
+		if(arch != NULL && !value_is(arch, FLAGS.arch.empty() ? DEFAULT_ARCH : FLAGS.arch)) 
+			return;
+
+		source.prebuilt = child.first_attribute("out") != NULL;
+		model.sources.push_back(source);
+	}
+	else if (child.is("link")) {
+		const xml_slice* compiler = child.first_attribute("compiler");
+		if (compiler != NULL) {
+			int target_compiler = check_compiler_str(compiler->data, compiler->size);
+			if (target_compiler == COMPILER)
+				model.link_files = parse_string(build_compiler_string(child.value.data, child.value.size, '\0', 0, 0));
+		}
+	}
+	else if (child.is("output") && !model.has_output) {
+		//Only the first <output> for this os and config is used.
+		if(!check_os(child))
+			return;
+		const xml_slice* config = child.first_attribute("config");
+		if (config != NULL && !value_is(config, FLAGS.config))
+			return;
+		model.has_output = 1;
+		model.output_name = child.value.str();
+		const xml_slice* output_type = child.first_attribute("type");
+		if (output_type != NULL)
+			model.output_type = output_type->str();
+		const xml_slice* lto = child.first_attribute("lto");
+		if (lto != NULL) {
+			if (value_is(lto, STR_LTO_FULL) || value_is(lto, STR_LTO_THIN))
+				model.lto = lto->str();
+			else if (!value_is(lto, "none"))
+				fprintf(stderr, "Warning: Unknown lto=\"%s\", expected full, thin or none.\n", lto->str().c_str());
+		}
+		const xml_slice* lto_cache = child.first_attribute("lto-cache");
+		model.lto_cache = !model.lto.empty() && lto_cache != NULL && value_is(lto_cache, "true");
+	}
+}
+
+/**
+ * @brief read_project resolves the children of a parsed <project> node.
+ * @param project the <project> node.
+ * @param model the model to fill.
+ */
+void read_project(xml_node<>* project, project_model& model) {
+	project_element element;
+	for (xml_node<>* child = project->first_node(); child; child = child->next_sibling()) {
+		if (child->type() != node_element) continue;
+		element.name = xml_slice(child->name(), child->name_size());
+		element.value = xml_slice(child->value(), child->value_size());
+		element.attributes.clear();
+		for (xml_attribute<>* a = child->first_attribute(); a; a = a->next_attribute()) {
+			element.attributes.push_back(xml_slice(a->name(), a->name_size()));
+			element.attributes.push_back(xml_slice(a->value(), a->value_size()));
+		}
+		read_element(element, model);
+	}
+	model.output_file = get_output_file(model.output_name, model.output_type);
+}
+
+typedef internal::lookup_tables<0> xml_tables;
+
+/**
+ * @brief stream_skip advances past the next occurrence of end.
+ * @param text the current position, updated.
+ * @param end the terminating sequence.
+ */
+void stream_skip(char*& text, const char* end) {
+	char* found = strstr(text, end);
+	if (found == NULL) throw parse_error("unexpected end of data", text);
+	text = found + strlen(end);
+}
+
+/**
+ * @brief stream_project reads a project in a single pass, handing each child
+ * element of <project> to read_element() as soon as it is complete instead of
+ * building a DOM, so parse memory stays constant regardless of project size.
+ * Like the DOM path, values are the first text run of an element and closing
+ * tags are not validated; read_element() translates entities for both.
+ * @param text the zero-terminated project file.
+ * @param model the model to fill.
+ * @return 1 if a <project> element was read, 0 otherwise.
+ */
+int stream_project(char* text, project_model& model) {
+	phase_timer timer(PHASE_PARSE);
+	project_element element;
+	int depth = 0;
+	int in_project = 0;
+	int found = 0;
+	//UTF-8 BOM.
+	if ((unsigned char) text[0] == 0xEF && (unsigned char) text[1] == 0xBB &&
+		(unsigned char) text[2] == 0xBF) text += 3;
+
+	while (*text) {
+		char* run = text;
+		while (*text && *text != '<') text++;
+		if (in_project && depth == 2 && element.value.size == 0 && text != run)
+			element.value = xml_slice(run, text - run);
+		if (!*text) break;
+		text++;
+
+		if (*text == '?') {
+			stream_skip(text, "?>");
+		}
+		else if (*text == '!') {
+			if (strncmp(text, "!--", 3) == 0) stream_skip(text, "-->");
+			else if (strncmp(text, "![CDATA[", 8) == 0) stream_skip(text, "]]>");
+			else {
+				//<!DOCTYPE ...> with an optional [internal subset].
+				int brackets = 0;
+				for (; *text && (*text != '>' || brackets > 0); text++) {
+					if (*text == '[') brackets++;
+					else if (*text == ']') brackets--;
+				}
+				if (!*text) throw parse_error("unexpected end of data", text);
+				text++;
+			}
+		}
+		else if (*text == '/') {
+			while (*text && *text != '>') text++;
+			if (!*text) throw parse_error("expected >", text);
+			text++;
+			if (in_project && depth == 2) read_element(element, model);
+			if (--depth == 0 && in_project) {
+				in_project = 0;
+				break;
+			}
+		}
+		else {
+			char* name = text;
+			while (xml_tables::lookup_node_name[(unsigned char) *text]) text++;
+			if (text == name) throw parse_error("expected element name", text);
+			depth++;
+			if (depth == 1 && !found && text - name == 7 && strncmp(name, "project", 7) == 0)
+				in_project = found = 1;
+			int child = in_project && depth == 2;
+			if (child) {
+				element.name = xml_slice(name, text - name);
+				element.value = xml_slice();
+				element.attributes.clear();
+			}
+
+			//Attributes.
+			while (true) {
+				while (xml_tables::lookup_whitespace[(unsigned char) *text]) text++;
+				char* attr = text;
+				while (xml_tables::lookup_attribute_name[(unsigned char) *text]) text++;
+				if (text == attr) break;
+				char* attr_end = text;
+				while (xml_tables::lookup_whitespace[(unsigned char) *text]) text++;
+				if (*text != '=') throw parse_error("expected =", text);
+				text++;
+				while (xml_tables::lookup_whitespace[(unsigned char) *text]) text++;
+				char quote = *text;
+				if (quote != '\'' && quote != '"') throw parse_error("expected ' or \"", text);
+				char* value = ++text;
+				while (*text && *text != quote) text++;
+				if (!*text) throw parse_error("expected ' or \"", text);
+				if (child) {
+					element.attributes.push_back(xml_slice(attr, attr_end - attr));
+					element.attributes.push_back(xml_slice(value, text - value));
+				}
+				text++;
+			}
+
+			if (*text == '/' && text[1] == '>') {
+				text += 2;
+				if (child) read_element(element, model);
+				if (--depth == 0 && in_project) {
+					in_project = 0;
+					break;
+				}
+			}
+			else if (*text == '>') text++;
+			else throw parse_error("expected >", text);
+		}
+	}
+	model.output_file = get_output_file(model.output_name, model.output_type);
+	return found;
+}
+
+/**
+ * @brief file_mtime returns the modification time of a stat'ed file in
+ * nanoseconds where the platform records it.
+ */
+long long file_mtime(const struct stat& s) {
+#if defined(__linux__)
+	return s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+	return s.st_mtimespec.tv_sec * 1000000000LL + s.st_mtimespec.tv_nsec;
+#else
+	return (long long) s.st_mtime * 1000000000LL;
+#endif
+}
+
+/**
+ * cache_writer serializes a project_model into a flat buffer of native
+ * endian integers and length-prefixed strings.
+ */
+struct cache_writer {
+	string data;
+
+	void u32(uint32_t v) { data.append((const char*) &v, sizeof(v)); }
+	void u64(uint64_t v) { data.append((const char*) &v, sizeof(v)); }
+	void str(const string& s) {
+		u32((uint32_t) s.size());
+		data += s;
+	}
+	void strs(const vector<string>& v) {
+		u32((uint32_t) v.size());
+		for (auto& s : v) str(s);
+	}
+
+	/**
+	 * @brief save writes the buffer to a temporary file and renames it over
+	 * path, so readers never see partial caches.
+	 */
+	void save(const string& path) {
+		string tmp = path + ".tmp";
+		FILE* fp = fopen(tmp.c_str(), "wb");
+		if (fp == NULL) return;
+		size_t written = fwrite(data.data(), 1, data.size(), fp);
+		fclose(fp);
+		if (written != data.size() || rename(tmp.c_str(), path.c_str()) != 0)
+			unlink(tmp.c_str());
+	}
+};
+
+/**
+ * cache_reader reads values written by cache_writer straight from a mapped
+ * cache file. Any read past the end marks the reader as failed.
+ */
+struct cache_reader {
+	const char* p;
+	const char* end;
+	int ok = 1;
+
+	cache_reader(const char* data, size_t size) : p(data), end(data + size) {}
+
+	int take(void* v, size_t size) {
+		if (!ok || (size_t) (end - p) < size) return ok = 0;
+		memcpy(v, p, size);
+		p += size;
+		return 1;
+	}
+	uint32_t u32() { uint32_t v = 0; take(&v, sizeof(v)); return v; }
+	uint64_t u64() { uint64_t v = 0; take(&v, sizeof(v)); return v; }
+	string str() {
+		uint32_t size = u32();
+		if (!ok || (size_t) (end - p) < size) {
+			ok = 0;
+			return EMPTY_STR;
+		}
+		string s(p, size);
+		p += size;
+		return s;
+	}
+	void strs(vector<string>& v) {
+		uint32_t count = u32();
+		for (uint32_t i = 0; ok && i < count; i++) v.push_back(str());
+	}
+};
+
+/**
+ * @brief cache_path returns the model cache file for a project file and the
+ * active compiler/arch/config: <dir>/.unbuild/<file>.<compiler>-<arch>-<config>.cache
+ * @param path the project xml path.
+ */
+string cache_path(const string& path) {
+	size_t pos = path.find_last_of('/');
+	string dir = pos == string::npos ? "" : path.substr(0, pos + 1);
+	string file = pos == string::npos ? path : path.substr(pos + 1);
+	return dir + CACHE_DIR + PATH_SEP + file + "." + FLAGS.variant + ".cache";
+}
+
+/**
+ * @brief write_model_header writes the cache key: the project file's path,
+ * size and mtime and the active compiler, config and arch.
+ */
+void write_model_header(cache_writer& w, const string& path, const struct stat& s) {
+	w.u32(CACHE_MAGIC);
+	w.u32(CACHE_VERSION);
+	w.str(path);
+	w.u64((uint64_t) s.st_size);
+	w.u64((uint64_t) file_mtime(s));
+	w.str(COMPILERS[COMPILER]);
+	w.str(FLAGS.config);
+	w.str(FLAGS.arch);
+}
+
+void write_steps(cache_writer& w, const vector<command_step>& steps) {
+	w.u32((uint32_t) steps.size());
+	for (auto& step : steps) {
+		w.str(step.command);
+		w.strs(step.inputs);
+		w.strs(step.outputs);
+	}
+}
+
+void read_steps(cache_reader& r, vector<command_step>& steps) {
+	uint32_t count = r.u32();
+	for (uint32_t i = 0; r.ok && i < count; i++) {
+		command_step step;
+		step.command = r.str();
+		r.strs(step.inputs);
+		r.strs(step.outputs);
+		steps.push_back(step);
+	}
+}
+
+/**
+ * @brief write_model_cache stores a resolved model for later invocations.
+ * Failures are ignored; the cache is only an optimisation.
+ */
+void write_model_cache(const string& path, const struct stat& s, project_model& model) {
+	cache_writer w;
+	write_model_header(w, path, s);
+	w.u32((uint32_t) model.depends.size());
+	for (auto& dep : model.depends) {
+		w.str(dep.path);
+		w.u32(dep.link);
+		w.u32(dep.include);
+	}
+	write_steps(w, model.prebuild);
+	write_steps(w, model.generate);
+	w.strs(model.includes);
+	w.str(model.flags.compiler_flags);
+	w.str(model.flags.linker_flags);
+	w.u32((uint32_t) model.flags.ext_flags.size());
+	for (auto& kv : model.flags.ext_flags) {
+		w.str(kv.first);
+		w.str(kv.second);
+	}
+	w.strs(model.usage_flags);
+	w.strs(model.usage_link_flags);
+	w.u32((uint32_t) model.sources.size());
+	for (auto& source : model.sources) {
+		w.str(source.filename);
+		w.u32(source.prebuilt);
+	}
+	w.str(model.link_files);
+	w.str(model.output_name);
+	w.str(model.output_type);
+	w.str(model.lto);
+	w.u32(model.lto_cache);
+	w.str(model.pgo);
+	w.str(model.modules);
+	w.u32(model.gc);
+	w.str(model.output_file);
+
+	string cache = cache_path(path);
+	mkdir(cache.substr(0, cache.find_last_of('/')).c_str());
+	w.save(cache);
+}
+
+/**
+ * @brief read_model_cache loads a model cached by write_model_cache() if its
+ * key still matches the project file and active compiler/config/arch.
+ * @return 1 if the model was loaded from the cache, 0 otherwise.
+ */
+int read_model_cache(const string& path, const struct stat& s, project_model& model) {
+	phase_timer timer(PHASE_CACHE);
+	string cache = cache_path(path);
+	struct stat s_cache;
+	if (stat_file(cache.c_str(), &s_cache) < 0) return 0;
+	mapped_file file;
+	if (!load_project(cache.c_str(), file)) return 0;
+
+	cache_writer key;
+	write_model_header(key, path, s);
+	int ok = file.size >= key.data.size() &&
+		memcmp(file.data, key.data.data(), key.data.size()) == 0;
+	if (ok) {
+		cache_reader r(file.data + key.data.size(), file.size - key.data.size());
+		uint32_t count = r.u32();
+		for (uint32_t i = 0; r.ok && i < count; i++) {
+			dependency dep;
+			dep.path = r.str();
+			dep.link = r.u32();
+			dep.include = r.u32();
+			model.depends.push_back(dep);
+		}
+		read_steps(r, model.prebuild);
+		read_steps(r, model.generate);
+		r.strs(model.includes);
+		model.flags.compiler_flags = r.str();
+		model.flags.linker_flags = r.str();
+		count = r.u32();
+		for (uint32_t i = 0; r.ok && i < count; i++) {
+			string ext = r.str();
+			model.flags.ext_flags[ext] = r.str();
+		}
+		r.strs(model.usage_flags);
+		r.strs(model.usage_link_flags);
+		count = r.u32();
+		for (uint32_t i = 0; r.ok && i < count; i++) {
+			project_source source;
+			source.filename = r.str();
+			source.prebuilt = r.u32();
+			model.sources.push_back(source);
+		}
+		model.link_files = r.str();
+		model.output_name = r.str();
+		model.output_type = r.str();
+		model.lto = r.str();
+		model.lto_cache = r.u32();
+		model.pgo = r.str();
+		model.modules = r.str();
+		model.gc = r.u32();
+		model.output_file = r.str();
+		ok = r.ok && r.p == r.end;
+		if (!ok) model = project_model();
+	}
+	unload_project(file);
+	return ok;
+}
+
+/**
+ * @brief load_models loads and parses a project file once and resolves it for
+ * every variant, using each variant's cache where it is current.
+ * @param path the project xml path.
+ * @param models filled with one model per variant.
+ * @return LOAD_OK, or the reason the project could not be loaded.
+ */
+int load_models(const char* path, vector<project_model>& models) {
+	size_t active = VARIANT;
+	models.assign(VARIANTS.size(), project_model());
+	struct stat s;
+	if (stat_file(path, &s) < 0) {
+		fprintf(stderr, "Error: Could not open %s.\n", path);
+		return LOAD_OPEN_FAILED;
+	}
+	vector<size_t> missing;
+	for (size_t i = 0; i < VARIANTS.size(); i++) {
+		use_variant(i);
+		if (read_model_cache(path, s, models[i])) {
+			if (FLAGS.verbose) printf("Loaded %s (%s) from cache.\n", path, FLAGS.variant.c_str());
+		}
+		else missing.push_back(i);
+	}
+	if (missing.empty()) {
+		use_variant(active);
+		return LOAD_OK;
+	}
+
+	mapped_file file;
+	if (!load_project(path, file)) {
+		use_variant(active);
+		return LOAD_OPEN_FAILED;
+	}
+
+	int result = LOAD_OK;
+	xml_document<>& doc = parse_document();
+	try {
+		if (FLAGS.stream || file.size >= STREAM_THRESHOLD) {
+			//The streaming reader doesn't keep the document, so it reads the
+			//(still loaded) file again for each variant.
+			if (FLAGS.verbose) printf("Streaming %s.\n", path);
+			for (size_t i : missing) {
+				use_variant(i);
+				if (!stream_project(file.data, models[i])) result = LOAD_NO_PROJECT;
+			}
+		}
+		else {
+			parse_project(doc, file);
+			xml_node<>* p = doc.first_node("project");
+			for (size_t i : missing) {
+				use_variant(i);
+				if (p != NULL) read_project(p, models[i]);
+				else result = LOAD_NO_PROJECT;
+			}
+		}
+	}
+	catch (const rapidxml::parse_error& ex) {
+		fprintf(stderr, "Error: Unable to parse %s.\n", path);
+		result = LOAD_PARSE_FAILED;
+	}
+	doc.clear();
+	unload_project(file);
+	if (result == LOAD_OK) {
+		for (size_t i : missing) {
+			use_variant(i);
+			write_model_cache(path, s, models[i]);
+		}
+	}
+	use_variant(active);
+	return result;
+}
+
+/**
+ * action is one command of the build graph. An action runs once every action
+ * it waits on has finished; actions without a command only order others.
+ */
+struct action {
+	string command;
+	string cwd; //Absolute; inputs, outputs and the response file are relative to it.
+	vector<string> inputs;
+	vector<string> outputs;
+	vector<string> optional_inputs; //Inputs that may not exist.
+	int always = 0; //Run even when the outputs are newer than the inputs.
+	//Touched after each successful run. The outputs are also current while
+	//the stamp is newer than the inputs, so a command that leaves unchanged
+	//outputs alone (restat) neither reruns nor invalidates what uses them.
+	string stamp;
+	string depfile; //Compiles: the headers of the last compile, from gcc -MMD.
+	const struct scan_context* scan = NULL; //Compiles: scan for headers instead.
+	string response_file; //Holds response while the command runs.
+	string response;
+	uint64_t toolchain = 0; //Fingerprint of the compiler or linker it runs.
+	struct module_scan* modules = NULL; //Orders module compiles instead of a command.
+	//Edges found while running (module imports), added by the job pool
+	//before the dependents are released.
+	vector<pair<action*, action*>> edges;
+	vector<action*> dependents;
+	int waiting = 0; //Unfinished actions this one waits on.
+	//Safe mode: the action, or one it waits on, was printed. It then also
+	//runs if it reads a file that would have been rewritten.
+	int stale = 0;
+};
+
+/**
+ * @brief hash_bytes is 64 bit FNV-1a.
+ * @param data the bytes to hash.
+ * @param size the number of bytes.
+ * @param hash the hash to continue from.
+ */
+uint64_t hash_bytes(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+uint64_t hash_string(const string& str, uint64_t hash = 14695981039346656037ULL) {
+	return hash_bytes(str.data(), str.size(), hash);
+}
+
+/**
+ * build_graph holds the actions of every project and variant in this run.
+ */
+struct build_graph {
+	deque<action> actions;
+	//Prebuild and generate steps by directory and command: a step that
+	//doesn't depend on the variant is run once for all of them.
+	unordered_map<string, action*> steps;
+	deque<struct scan_context> scans; //Include paths of the compiles.
+
+	action* add(const string& cwd) {
+		actions.push_back(action());
+		actions.back().cwd = cwd;
+		return &actions.back();
+	}
+};
+
+static build_graph GRAPH;
+
+void add_edge(action* before, action* after) {
+	before->dependents.push_back(after);
+	after->waiting++;
+}
+
+/**
+ * include_directive is one #include in a file: the name between the quotes or
+ * angle brackets.
+ */
+struct include_directive {
+	string name;
+	int quoted = 0;
+};
+
+/**
+ * scanned_file keys a file's directives on its content hash; the mtime and
+ * size tell whether the file must be read again.
+ */
+struct scanned_file {
+	long long mtime = 0;
+	uint64_t size = 0;
+	uint64_t hash = 0;
+	int checked = 0; //Stat'ed in this run.
+};
+
+/**
+ * @brief lex_includes finds the #include directives in a source or header.
+ * Conditionals are ignored, so every include that may be taken is found;
+ * includes of macros are skipped.
+ * @param p the file contents.
+ * @param end the end of the contents.
+ * @param includes the directives, appended to.
+ */
+void lex_includes(const char* p, const char* end, vector<include_directive>& includes) {
+	int line_start = 1;
+	while (p < end) {
+		char c = *p;
+		if (c == '\n') {
+			line_start = 1;
+			p++;
+		}
+		else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+			p++;
+		}
+		else if (c == '/' && p + 1 < end && p[1] == '*') {
+			//Block comments don't end the line's whitespace prefix.
+			p += 2;
+			while (p + 1 < end && !(p[0] == '*' && p[1] == '/')) p++;
+			p += 2;
+		}
+		else if (c == '/' && p + 1 < end && p[1] == '/') {
+			while (p < end && *p != '\n') p++;
+		}
+		else if (c == '#' && line_start) {
+			line_start = 0;
+			p++;
+			while (p < end && (*p == ' ' || *p == '\t')) p++;
+			const char* word = p;
+			while (p < end && *p >= 'a' && *p <= 'z') p++;
+			if ((p - word == 7 && strncmp(word, "include", 7) == 0) ||
+				(p - word == 6 && strncmp(word, "import", 6) == 0)) {
+				while (p < end && (*p == ' ' || *p == '\t')) p++;
+				if (p < end && (*p == '"' || *p == '<')) {
+					char close = *p == '"' ? '"' : '>';
+					const char* name = ++p;
+					while (p < end && *p != close && *p != '\n') p++;
+					if (p < end && *p == close) {
+						include_directive d;
+						d.name.assign(name, p - name);
+						d.quoted = close == '"';
+						includes.push_back(d);
+					}
+				}
+			}
+			while (p < end && *p != '\n') p++;
+		}
+		else if (c == '"' || c == '\'') {
+			line_start = 0;
+			p++;
+			while (p < end && *p != c && *p != '\n') {
+				if (*p == '\\') p++;
+				p++;
+			}
+			p++;
+		}
+		else {
+			line_start = 0;
+			p++;
+		}
+	}
+}
+
+/**
+ * @brief normalize_path removes . and dir/.. components, so a header reached
+ * through different include paths is scanned once.
+ */
+string normalize_path(const string& path) {
+	vector<string> parts, out;
+	tokenize(path, parts, PATH_SEP, true);
+	for (auto& part : parts) {
+		if (part == ".") continue;
+		if (part == ".." && !out.empty() && out.back() != "..") out.pop_back();
+		else out.push_back(part);
+	}
+	string normal = path[0] == '/' ? PATH_SEP : EMPTY_STR;
+	for (size_t i = 0; i < out.size(); i++) normal += (i ? PATH_SEP : EMPTY_STR) + out[i];
+	return normal;
+}
+
+/**
+ * @brief include_dirs returns the directories of the -I (/I) flags of a
+ * compile command's includes, absolute.
+ * @param includes the include flags, as built by step_build_dependencies().
+ * @param cwd the directory the compile runs in.
+ */
+vector<string> include_dirs(const string& includes, const string& cwd) {
+	vector<string> dirs;
+	string flag = COMPILER_FLAG[COMPILER] + "I\"";
+	for (size_t pos = includes.find(flag); pos != string::npos; pos = includes.find(flag, pos)) {
+		pos += flag.size();
+		size_t close = includes.find('"', pos);
+		if (close == string::npos) break;
+		string dir = includes.substr(pos, close - pos);
+		dirs.push_back(normalize_path(dir[0] == '/' ? dir : cwd + PATH_SEP + dir));
+		pos = close;
+	}
+	return dirs;
+}
+
+/**
+ * scan_context is the include path of the compiles of a project.
+ */
+struct scan_context {
+	vector<string> dirs;
+	string key; //The dirs, for the resolved include cache.
+};
+
+/**
+ * include_scanner finds the headers a source includes without running the
+ * compiler. Each header is stat'ed and lexed at most once per run, whichever
+ * compile needs it first, and its directives are kept by content hash in
+ * .unbuild/includes.cache, so unchanged headers aren't read again.
+ * Compiles scan in parallel; the maps are shared under one lock.
+ */
+struct include_scanner {
+	mutex lock;
+	unordered_map<string, scanned_file> files;
+	unordered_map<uint64_t, vector<include_directive>> directives;
+	unordered_map<string, string> resolved; //Empty if not found.
+	int changed = 0;
+
+	/**
+	 * @brief scan returns the directives of a file, NULL if it can't be read.
+	 * @param path the absolute path.
+	 */
+	const vector<include_directive>* scan(const string& path) {
+		{
+			lock_guard<mutex> l(lock);
+			auto it = files.find(path);
+			if (it != files.end() && it->second.checked) return &directives[it->second.hash];
+		}
+		struct stat s;
+		if (stat_file(path.c_str(), &s) < 0) return NULL;
+		{
+			lock_guard<mutex> l(lock);
+			auto it = files.find(path);
+			if (it != files.end() && it->second.mtime == file_mtime(s) &&
+				it->second.size == (uint64_t) s.st_size && directives.count(it->second.hash)) {
+				it->second.checked = 1;
+				return &directives[it->second.hash];
+			}
+		}
+		mapped_file file;
+		if (!load_project(path.c_str(), file)) return NULL;
+		scanned_file scanned;
+		scanned.mtime = file_mtime(s);
+		scanned.size = (uint64_t) s.st_size;
+		scanned.hash = hash_bytes(file.data, file.size);
+		scanned.checked = 1;
+		vector<include_directive> includes;
+		int known;
+		{
+			lock_guard<mutex> l(lock);
+			known = directives.count(scanned.hash) != 0;
+		}
+		if (!known) lex_includes(file.data, file.data + file.size, includes);
+		unload_project(file);
+
+		lock_guard<mutex> l(lock);
+		files[path] = scanned;
+		changed = 1;
+		auto d = directives.find(scanned.hash);
+		if (d == directives.end()) d = directives.emplace(scanned.hash, includes).first;
+		return &d->second;
+	}
+
+	/**
+	 * @brief resolve finds an included file: quoted names in the including
+	 * file's directory first, then the include path. Headers found in
+	 * neither (the system's) aren't tracked.
+	 * @return the normalized path, empty if not found.
+	 */
+	string resolve(const string& dir, const include_directive& d, const scan_context& context) {
+		string key = context.key + '\0' + (d.quoted ? dir : EMPTY_STR) + '\0' + d.name;
+		{
+			lock_guard<mutex> l(lock);
+			auto it = resolved.find(key);
+			if (it != resolved.end()) return it->second;
+		}
+		string found;
+		struct stat s;
+		if (d.name[0] == '/') {
+			if (stat_file(d.name.c_str(), &s) == 0) found = normalize_path(d.name);
+		}
+		else {
+			if (d.quoted) {
+				string path = dir + PATH_SEP + d.name;
+				if (stat_file(path.c_str(), &s) == 0) found = normalize_path(path);
+			}
+			for (size_t i = 0; found.empty() && i < context.dirs.size(); i++) {
+				string path = context.dirs[i] + PATH_SEP + d.name;
+				if (stat_file(path.c_str(), &s) == 0) found = normalize_path(path);
+			}
+		}
+		lock_guard<mutex> l(lock);
+		resolved[key] = found;
+		return found;
+	}
+
+	/**
+	 * @brief dependencies collects every header a source includes, directly
+	 * or through other headers.
+	 * @param source the absolute source path.
+	 * @param context the include path.
+	 * @param deps the headers, appended to.
+	 */
+	void dependencies(const string& source, const scan_context& context, vector<string>& deps) {
+		phase_timer timer(PHASE_SCAN);
+		unordered_set<string> seen;
+		vector<string> pending(1, normalize_path(source));
+		seen.insert(pending[0]);
+		while (!pending.empty()) {
+			string file = pending.back();
+			pending.pop_back();
+			const vector<include_directive>* includes = scan(file);
+			if (includes == NULL) continue;
+			string dir = dir_name(file);
+			for (auto& d : *includes) {
+				string path = resolve(dir, d, context);
+				if (!path.empty() && seen.insert(path).second) {
+					deps.push_back(path);
+					pending.push_back(path);
+				}
+			}
+		}
+	}
+
+	void load(const string& path) {
+		mapped_file file;
+		struct stat s;
+		if (stat_file(path.c_str(), &s) < 0 || !load_project(path.c_str(), file)) return;
+		cache_reader r(file.data, file.size);
+		if (r.u32() == CACHE_MAGIC && r.u32() == CACHE_VERSION) {
+			uint32_t count = r.u32();
+			for (uint32_t i = 0; r.ok && i < count; i++) {
+				string name = r.str();
+				scanned_file& f = files[name];
+				f.mtime = (long long) r.u64();
+				f.size = r.u64();
+				f.hash = r.u64();
+			}
+			count = r.u32();
+			for (uint32_t i = 0; r.ok && i < count; i++) {
+				vector<include_directive>& includes = directives[r.u64()];
+				uint32_t n = r.u32();
+				for (uint32_t j = 0; r.ok && j < n; j++) {
+					include_directive d;
+					d.name = r.str();
+					d.quoted = r.u32();
+					includes.push_back(d);
+				}
+			}
+		}
+		if (!r.ok) {
+			files.clear();
+			directives.clear();
+		}
+		unload_project(file);
+	}
+
+	/**
+	 * @brief save writes the files scanned in this run (and their directives)
+	 * if any had to be read.
+	 */
+	void save(const string& path) {
+		if (!changed) return;
+		cache_writer w;
+		w.u32(CACHE_MAGIC);
+		w.u32(CACHE_VERSION);
+		unordered_set<uint64_t> used;
+		uint32_t count = 0;
+		for (auto& kv : files) count += kv.second.checked;
+		w.u32(count);
+		for (auto& kv : files) {
+			if (!kv.second.checked) continue;
+			w.str(kv.first);
+			w.u64((uint64_t) kv.second.mtime);
+			w.u64(kv.second.size);
+			w.u64(kv.second.hash);
+			used.insert(kv.second.hash);
+		}
+		w.u32((uint32_t) used.size());
+		for (uint64_t hash : used) {
+			w.u64(hash);
+			vector<include_directive>& includes = directives[hash];
+			w.u32((uint32_t) includes.size());
+			for (auto& d : includes) {
+				w.str(d.name);
+				w.u32(d.quoted);
+			}
+		}
+		w.save(path);
+	}
+};
+
+static include_scanner INCLUDES;
+
+/**
+ * @brief read_depfile reads the prerequisites of a make rule written by
+ * gcc -MMD: "obj: src hdr \
+ *  hdr2".
+ * @param path the depfile.
+ * @param deps the prerequisites, appended to.
+ * @return 1 if the depfile was read, 0 if it doesn't exist.
+ */
+int read_depfile(const string& path, vector<string>& deps) {
+	struct stat s;
+	mapped_file file;
+	if (stat_file(path.c_str(), &s) < 0 || !load_project(path.c_str(), file)) return 0;
+	const char* p = file.data;
+	const char* end = file.data + file.size;
+	//Skip the target; a ':' in it (C:\...) isn't followed by whitespace.
+	while (p < end && !(*p == ':' && (p + 1 == end || isspace((unsigned char) p[1])))) p++;
+	if (p < end) p++;
+	string dep;
+	for (; p <= end; p++) {
+		char c = p < end ? *p : ' ';
+		if (c == '\\' && p + 1 < end && (p[1] == ' ' || p[1] == '#')) {
+			dep += *++p;
+		}
+		else if (c == '\\' && p + 1 < end && (p[1] == '\n' || p[1] == '\r')) {
+			p++;
+		}
+		else if (isspace((unsigned char) c)) {
+			if (!dep.empty()) deps.push_back(dep);
+			dep.clear();
+			//Only the first rule lists headers; the rest are -MP phony targets
+			//or, with modules, the CMI rules.
+			if (c == '\n') break;
+		}
+		else if (c == '$' && p + 1 < end && p[1] == '$') {
+			dep += *++p;
+		}
+		else dep += c;
+	}
+	unload_project(file);
+	return 1;
+}
+
+/**
+ * @brief header_deps lists the headers of a compile. They come from the
+ * include scanner with --scan-includes, otherwise from the depfile of the
+ * last compile.
+ * @param a the compile.
+ * @param deps the headers, appended to.
+ * @return 0 if the depfile is missing (the first build), 1 otherwise.
+ */
+int header_deps(const action& a, vector<string>& deps) {
+	if (a.scan != NULL) {
+		const string& source = a.inputs[0];
+		INCLUDES.dependencies(source[0] == '/' ? source : a.cwd + PATH_SEP + source, *a.scan, deps);
+	}
+	else if (!a.depfile.empty()) {
+		if (!read_depfile(a.cwd + PATH_SEP + a.depfile, deps)) return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief headers_dirty checks the headers of a compile against its object;
+ * without a depfile it's dirty.
+ * @param a the compile.
+ * @param oldest the object's mtime.
+ * @return 1 if a header is newer or missing, 0 otherwise.
+ */
+int headers_dirty(const action& a, long long oldest) {
+	vector<string> deps;
+	if (!header_deps(a, deps)) return 1;
+	struct stat s;
+	for (auto& dep : deps) {
+		string path = dep[0] == '/' ? dep : a.cwd + PATH_SEP + dep;
+		if (stat_file(path.c_str(), &s) < 0 || file_mtime(s) > oldest) return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief capture_process runs a command and collects what it prints.
+ * @param command the command.
+ * @param out stdout and stderr, appended to.
+ * @return the exit status.
+ */
+int capture_process(const string& command, string& out) {
+	count(COUNTER_SPAWNED);
+	phase_timer timer(PHASE_SPAWN);
+	FILE* fp = popen((command + " 2>&1").c_str(), "r");
+	if (fp == NULL) return -1;
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) out.append(buffer, n);
+	return pclose(fp);
+}
+
+/**
+ * @brief find_program resolves a tool name through PATH.
+ * @return the tool's path, empty if it isn't found.
+ */
+string find_program(const string& name) {
+	struct stat s;
+	if (name.find_first_of("/\\") != string::npos)
+		return stat_file(name.c_str(), &s) == 0 ? name : EMPTY_STR;
+	const char* env = getenv("PATH");
+	if (env == NULL) return EMPTY_STR;
+#ifdef _WIN32
+	const char list_sep = ';';
+	const char* exts[] = { ".exe", "" };
+#else
+	const char list_sep = ':';
+	const char* exts[] = { "" };
+#endif
+	string paths(env);
+	size_t start = 0;
+	while (start <= paths.size()) {
+		size_t end = paths.find(list_sep, start);
+		if (end == string::npos) end = paths.size();
+		string dir = end > start ? paths.substr(start, end - start) : ".";
+		for (const char* ext : exts) {
+			string path = dir + PATH_SEP + name + ext;
+			if (stat_file(path.c_str(), &s) == 0 && (s.st_mode & S_IFMT) == S_IFREG) return path;
+		}
+		start = end + 1;
+	}
+	return EMPTY_STR;
+}
+
+/**
+ * toolchain is what a compiler or linker binary was when it was last probed.
+ */
+struct toolchain {
+	long long mtime = 0;
+	uint64_t size = 0;
+	uint64_t fingerprint = 0;
+	int checked = 0; //Stat'ed in this run.
+};
+
+/**
+ * toolchain_cache fingerprints the tools commands run: the resolved path,
+ * the version they print and, for the compiler, the macros it predefines for
+ * the arch. Probing spawns the tool, so fingerprints are kept in
+ * .unbuild/toolchains.cache and probed again only when the binary's size or
+ * mtime changes. Only used while planning, from one thread.
+ */
+struct toolchain_cache {
+	unordered_map<string, toolchain> tools; //By path and arch flag.
+	unordered_map<string, uint64_t> commands; //By tool name and arch flag.
+	int changed = 0;
+
+	/**
+	 * @brief fingerprint returns the fingerprint of the tool a command runs.
+	 * @param command the command; its first word is the tool.
+	 * @return the fingerprint, 0 if the tool can't be found.
+	 */
+	uint64_t fingerprint(const string& command) {
+		string name = command.substr(0, command.find(' '));
+		string arch = COMPILER == COMPILER_GCC && !FLAGS.arch.empty() ? "-m" + FLAGS.arch : EMPTY_STR;
+		string memo = name + '\0' + arch;
+		auto known = commands.find(memo);
+		if (known != commands.end()) return known->second;
+
+		string path = find_program(name);
+		struct stat s;
+		if (path.empty() || stat_file(path.c_str(), &s) < 0) return commands[memo] = 0;
+		toolchain& tool = tools[path + '\0' + arch];
+		tool.checked = 1;
+		if (tool.fingerprint == 0 || tool.mtime != file_mtime(s) || tool.size != (uint64_t) s.st_size) {
+			if (FLAGS.verbose) printf("Probing %s.\n", path.c_str());
+			string quoted = "\"" + path + "\"";
+			string out;
+			if (COMPILER == COMPILER_MSVC) {
+				capture_process(quoted, out); //The banner has the version and target.
+			}
+			else {
+				capture_process(quoted + " --version", out);
+				if (name == COMPILER_BINS[COMPILER])
+					capture_process(quoted + " " + arch + " -dM -E -x c " + OUTPUT_NULL[COMPILER], out);
+			}
+			tool.mtime = file_mtime(s);
+			tool.size = (uint64_t) s.st_size;
+			tool.fingerprint = hash_string(out, hash_string(path));
+			changed = 1;
+		}
+		return commands[memo] = tool.fingerprint;
+	}
+
+	void load(const string& path) {
+		mapped_file file;
+		struct stat s;
+		if (stat_file(path.c_str(), &s) < 0 || !load_project(path.c_str(), file)) return;
+		cache_reader r(file.data, file.size);
+		if (r.u32() == CACHE_MAGIC && r.u32() == CACHE_VERSION) {
+			uint32_t count = r.u32();
+			for (uint32_t i = 0; r.ok && i < count; i++) {
+				string key = r.str();
+				toolchain& tool = tools[key];
+				tool.mtime = (long long) r.u64();
+				tool.size = r.u64();
+				tool.fingerprint = r.u64();
+			}
+		}
+		if (!r.ok) tools.clear();
+		unload_project(file);
+	}
+
+	void save(const string& path) {
+		if (!changed) return;
+		cache_writer w;
+		w.u32(CACHE_MAGIC);
+		w.u32(CACHE_VERSION);
+		w.u32((uint32_t) tools.size());
+		for (auto& kv : tools) {
+			w.str(kv.first);
+			w.u64((uint64_t) kv.second.mtime);
+			w.u64(kv.second.size);
+			w.u64(kv.second.fingerprint);
+		}
+		w.save(path);
+	}
+};
+
+static toolchain_cache TOOLCHAINS;
+
+/**
+ * command_log is the hash of the command (and toolchain) each output was
+ * last built with, kept in .unbuild/commands.log. An output whose command
+ * changed, or that has no entry, is rebuilt even when it is newer than its
+ * inputs. Actions check and record entries in parallel, under one lock.
+ */
+struct command_log {
+	mutex lock;
+	unordered_map<string, uint64_t> entries; //By absolute output path.
+	int changed = 0;
+
+	int matches(const string& output, uint64_t hash) {
+		lock_guard<mutex> l(lock);
+		auto it = entries.find(output);
+		return it != entries.end() && it->second == hash;
+	}
+
+	void record(const string& output, uint64_t hash) {
+		lock_guard<mutex> l(lock);
+		uint64_t& entry = entries[output];
+		if (entry != hash) changed = 1;
+		entry = hash;
+	}
+
+	void forget(const string& output) {
+		lock_guard<mutex> l(lock);
+		if (entries.erase(output)) changed = 1;
+	}
+
+	void load(const string& path) {
+		mapped_file file;
+		struct stat s;
+		if (stat_file(path.c_str(), &s) < 0 || !load_project(path.c_str(), file)) return;
+		cache_reader r(file.data, file.size);
+		if (r.u32() == CACHE_MAGIC && r.u32() == CACHE_VERSION) {
+			uint32_t count = r.u32();
+			for (uint32_t i = 0; r.ok && i < count; i++) {
+				string output = r.str();
+				entries[output] = r.u64();
+			}
+		}
+		if (!r.ok) entries.clear();
+		unload_project(file);
+	}
+
+	void save(const string& path) {
+		if (!changed) return;
+		cache_writer w;
+		w.u32(CACHE_MAGIC);
+		w.u32(CACHE_VERSION);
+		w.u32((uint32_t) entries.size());
+		for (auto& kv : entries) {
+			w.str(kv.first);
+			w.u64(kv.second);
+		}
+		w.save(path);
+	}
+};
+
+static command_log COMMANDS;
+
+/**
+ * stale_files holds, in safe mode, the outputs of the actions that were
+ * printed: a real run would rewrite them, so whatever reads them would run
+ * too. Paths are absolute and normalized.
+ */
+struct stale_files {
+	mutex lock;
+	unordered_set<string> files;
+
+	void add(const string& file) {
+		lock_guard<mutex> l(lock);
+		files.insert(normalize_path(file));
+	}
+
+	int contains(const string& file) {
+		string path = normalize_path(file);
+		lock_guard<mutex> l(lock);
+		return files.count(path) != 0;
+	}
+};
+
+static stale_files STALE;
+
+/**
+ * @brief command_hash hashes what an action's outputs are built with.
+ */
+uint64_t command_hash(const action& a) {
+	uint64_t hash = hash_bytes((const char*) &a.toolchain, sizeof(a.toolchain));
+	return hash_string(a.response, hash_string(a.command, hash));
+}
+
+/**
+ * @brief action_path returns the absolute path of a file an action names.
+ */
+string action_path(const action& a, const string& file) {
+	return file[0] == '/' ? file : a.cwd + PATH_SEP + file;
+}
+
+/**
+ * @brief action_dirty checks an action's outputs against its inputs.
+ * @return 1 if the action needs to run, 0 if it is up to date, -1 if an input
+ * is missing.
+ */
+int action_dirty(const action& a) {
+	phase_timer timer(PHASE_CHECK);
+	struct stat s;
+	long long newest = -1;
+	for (auto& input : a.inputs) {
+		string path = input[0] == '/' ? input : a.cwd + PATH_SEP + input;
+		if (stat_file(path.c_str(), &s) < 0) {
+			//In safe mode the step making it hasn't run.
+			if (FLAGS.safemode) return 1;
+			printf("Error: %s could not be opened.\n", input.c_str());
+			return -1;
+		}
+		if (file_mtime(s) > newest) newest = file_mtime(s);
+	}
+	for (auto& input : a.optional_inputs) {
+		string path = input[0] == '/' ? input : a.cwd + PATH_SEP + input;
+		if (stat_file(path.c_str(), &s) == 0 && file_mtime(s) > newest) newest = file_mtime(s);
+	}
+	if (a.always || a.outputs.empty()) return 1;
+	long long oldest = -1;
+	for (auto& output : a.outputs) {
+		string path = output[0] == '/' ? output : a.cwd + PATH_SEP + output;
+		if (stat_file(path.c_str(), &s) < 0) return 1;
+		if (oldest < 0 || file_mtime(s) < oldest) oldest = file_mtime(s);
+	}
+	if (!COMMANDS.matches(action_path(a, a.outputs[0]), command_hash(a))) return 1;
+	if (oldest >= newest) return headers_dirty(a, oldest);
+	if (a.stamp.empty()) return 1;
+	string stamp = a.cwd + PATH_SEP + a.stamp;
+	return stat_file(stamp.c_str(), &s) < 0 || file_mtime(s) < newest;
+}
+
+/**
+ * @brief reads_stale checks, in safe mode, whether an action that waits on a
+ * printed one reads any of the files it would have rewritten.
+ */
+int reads_stale(const action& a) {
+	vector<string> files = a.inputs;
+	files.insert(files.end(), a.optional_inputs.begin(), a.optional_inputs.end());
+	header_deps(a, files);
+	for (auto& file : files)
+		if (STALE.contains(action_path(a, file))) return 1;
+	return 0;
+}
+
+int resolve_modules(action& a);
+
+/**
+ * @brief run_action runs an action's command if it is out of date. In safe
+ * mode the command is only printed, and the actions after it that read its
+ * outputs count as out of date, as they would be after a real run.
+ * @return 0 on success, non-zero if the command or a check failed.
+ */
+int run_action(action& a) {
+	if (a.modules != NULL) return resolve_modules(a);
+	if (a.command.empty()) return 0;
+	int dirty = action_dirty(a);
+	if (dirty == 0 && a.stale) dirty = reads_stale(a);
+	if (dirty <= 0) return dirty < 0;
+
+	printf("%s\n", a.response.empty() ? a.command.c_str() : a.response.c_str());
+	fflush(stdout);
+	if (FLAGS.safemode) {
+		a.stale = 1;
+		for (auto& output : a.outputs) STALE.add(action_path(a, output));
+		return 0;
+	}
+	string response_file;
+	if (!a.response_file.empty()) {
+		response_file = a.cwd + PATH_SEP + a.response_file;
+		FILE* tmp = fopen(response_file.c_str(), "w");
+		if (tmp == NULL) {
+			fprintf(stderr, "Error: Could not write %s.\n", response_file.c_str());
+			return 1;
+		}
+		fwrite(a.response.c_str(), sizeof(char), a.response.size(), tmp);
+		fclose(tmp);
+	}
+	int result = run_process(a.command, a.cwd);
+	if (!response_file.empty()) unlink(response_file.c_str());
+	if (result == 0 && !a.stamp.empty()) {
+		string stamp = a.cwd + PATH_SEP + a.stamp;
+		FILE* fp = fopen(stamp.c_str(), "w");
+		if (fp != NULL) fclose(fp);
+	}
+	if (result == 0 && !a.outputs.empty()) COMMANDS.record(action_path(a, a.outputs[0]), command_hash(a));
+	return result;
+}
+
+/**
+ * @brief job_pool runs the build graph on a fixed number of worker threads,
+ * starting each action as soon as the actions it waits on are done, whatever
+ * project or variant they belong to. Once an action fails no more are
+ * started, and run() reports the first error.
+ */
+struct job_pool {
+	deque<action*> ready;
+	mutex lock;
+	condition_variable work_ready;
+	size_t remaining = 0;
+	int running = 0;
+	int error = 0;
+	bool stopping = false;
+
+	void worker() {
+		unique_lock<mutex> l(lock);
+		while (true) {
+			work_ready.wait(l, [this] { return stopping || !ready.empty(); });
+			if (stopping) return;
+			action* a = ready.front();
+			ready.pop_front();
+			running++;
+			l.unlock();
+			int result = run_action(*a);
+			l.lock();
+			running--;
+			remaining--;
+			if (result != 0 && !error) {
+				//Retire what's queued: nothing more is started after a failure.
+				error = result;
+				remaining -= ready.size();
+				ready.clear();
+			}
+			for (auto& edge : a->edges) add_edge(edge.first, edge.second);
+			if (!error) {
+				for (action* next : a->dependents) {
+					if (a->stale) next->stale = 1;
+					if (--next->waiting == 0) ready.push_back(next);
+				}
+			}
+			if (remaining == 0 || (running == 0 && (error || ready.empty()))) {
+				//Done, failed, or (with nothing left to start) an ordering cycle.
+				if (!error && remaining > 0) {
+					fprintf(stderr, "Error: Build order contains a cycle.\n");
+					error = 1;
+				}
+				stopping = true;
+				work_ready.notify_all();
+			}
+			else work_ready.notify_all();
+		}
+	}
+
+	/**
+	 * @brief run runs every action in the graph.
+	 * @param graph the build graph.
+	 * @param jobs the number of worker threads.
+	 * @return the first non-zero action result, 0 if all succeeded.
+	 */
+	int run(build_graph& graph, int jobs) {
+		remaining = graph.actions.size();
+		if (remaining == 0) return 0;
+		for (auto& a : graph.actions)
+			if (a.waiting == 0) ready.push_back(&a);
+		if (ready.empty()) {
+			fprintf(stderr, "Error: Build order contains a cycle.\n");
+			return 1;
+		}
+		vector<thread> workers;
+		for (int i = 0; i < jobs; i++)
+			workers.push_back(thread(&job_pool::worker, this));
+		for (auto& t : workers) t.join();
+		return error;
+	}
+};
+
+static job_pool JOBS;
+
+/**
+ * project_usage is what a project takes from its dependencies and what it
+ * passes on to the projects that depend on it, in one variant. Paths are
+ * absolute, each listed once: include dirs in search order, libraries in
+ * link order (each after every library that uses it). Propagated flags are
+ * kept per <flags> element, each once, nearest first.
+ */
+struct project_usage {
+	vector<string> includes; //The project's include dirs, then its dependencies'.
+	vector<string> libraries; //What linking against the project takes.
+	vector<string> dep_includes; //The include dirs of its dependencies.
+	vector<string> dep_libraries; //What the project's own output links.
+	vector<string> flags; //Propagated compile flags: the project's, then its dependencies'.
+	vector<string> link_flags; //Propagated link flags that go with libraries.
+	vector<string> dep_flags; //The propagated compile flags of its dependencies.
+	vector<string> dep_link_flags; //The propagated link flags its own output takes.
+	int computed = 0;
+	int computing = 0;
+};
+
+/**
+ * project_plan is a project resolved for every variant, and the action that
+ * finishes its build in each variant once planned.
+ */
+struct project_plan {
+	string dir; //Absolute directory commands run in.
+	vector<project_model> models;
+	vector<action*> done; //NULL until planned.
+	vector<int> planning;
+	vector<project_usage> usages;
+};
+
+//Projects by path, so each is loaded and planned once however often it is
+//depended on.
+static unordered_map<string, project_plan*> PLANS;
+static deque<project_plan> PLAN_STORE;
+
+/**
+ * @brief plan_project loads a project for every variant, once.
+ * @param file the project file, relative to the current directory.
+ * @param plan set to the project's plan.
+ * @return LOAD_OK, or the reason the project could not be loaded.
+ */
+int plan_project(const string& file, project_plan*& plan) {
+	char* cwd = pgetcwd();
+	string dir = cwd;
+	free(cwd);
+	string key = dir + PATH_SEP + file;
+	auto it = PLANS.find(key);
+	if (it != PLANS.end()) {
+		plan = it->second;
+		return LOAD_OK;
+	}
+	PLAN_STORE.push_back(project_plan());
+	plan = &PLAN_STORE.back();
+	plan->dir = dir;
+	int result = load_models(file.c_str(), plan->models);
+	if (result != LOAD_OK) {
+		PLAN_STORE.pop_back();
+		plan = NULL;
+		return result;
+	}
+	plan->done.assign(VARIANTS.size(), NULL);
+	plan->planning.assign(VARIANTS.size(), 0);
+	plan->usages.assign(VARIANTS.size(), project_usage());
+	PLANS[key] = plan;
+	return LOAD_OK;
 }
 
-int check_compiler_str(const char* str) {
-	for (unsigned int i = 0; i < COMPILERS.size(); i++) {
-		if (COMPILERS.at(i) == str) {
-			return i;
-		}
-	}
-	return -1;
+//Forward define plan_build to allow dependent projects to call it.
+int plan_build(project_plan& plan, action*& done);
+
+/**
+ * @brief relative_path returns the path from one absolute directory to another.
+ */
+string relative_path(const string& from, const string& to) {
+	vector<string> a, b;
+	tokenize(from, a, PATH_SEP, true);
+	tokenize(to, b, PATH_SEP, true);
+	size_t common = 0;
+	while (common < a.size() && common < b.size() && a[common] == b[common]) common++;
+	string path;
+	for (size_t i = common; i < a.size(); i++) path += (path.empty() ? "" : PATH_SEP) + string("..");
+	for (size_t i = common; i < b.size(); i++) path += (path.empty() ? "" : PATH_SEP) + b[i];
+	return path.empty() ? "." : path;
 }
 
-void step_build_output(xml_node<>* project, string& compiled_files, build_flags* f) {
-	//Produce output (link/lib...)
-	xml_node<>* output_node = project->first_node("output");
+/**
+ * @brief unique_paths drops all but the first occurrence of each path, so
+ * include dirs keep their nearest place in the search order.
+ */
+void unique_paths(vector<string>& paths) {
+	unordered_set<string> seen;
+	size_t kept = 0;
+	for (size_t i = 0; i < paths.size(); i++)
+		if (seen.insert(paths[i]).second) paths[kept++] = paths[i];
+	paths.resize(kept);
+}
 
-	if (output_node != NULL && compiled_files.length() > 0) {
-		string output_name = get_output_file(output_node);
-		xml_attribute<>* output_type_attr = output_node->first_attribute("type");
+/**
+ * @brief link_order drops all but the last occurrence of each library, so
+ * each comes after every library that uses it.
+ */
+void link_order(vector<string>& libraries) {
+	unordered_set<string> seen;
+	vector<string> ordered;
+	for (auto it = libraries.rbegin(); it != libraries.rend(); ++it)
+		if (seen.insert(*it).second) ordered.push_back(*it);
+	libraries.assign(ordered.rbegin(), ordered.rend());
+}
 
-		if (output_type_attr != NULL) {
-			char* output_type = output_type_attr->value();
-			int operation = -1;
-			output f_output;
+/**
+ * @brief load_dependency loads a <depends> project, relative to the current
+ * directory.
+ * @param dep the dependency.
+ * @param plan set to the project's plan, NULL if the path has no project file.
+ * @return 0 on success, 1 if the dependency can't be loaded.
+ */
+int load_dependency(const dependency& dep, project_plan*& plan) {
+	plan = NULL;
+	const string& project = dep.path;
+	struct stat dependency;
+	if(stat_file(project.c_str(), &dependency) < 0) {
+		printf("Error: %s could not be opened.\n", project.c_str());
+		return 1; //Could not stat input file.
+	}
+	int is_file = !((dependency.st_mode & S_IFDIR) == S_IFDIR);
+	//Determine if the project is in a different directory. (contains /)
+	size_t pos = project.find_last_of('/');
+	if (pos == string::npos) pos = 0;
 
-			for (xml_node<> *child = project->first_node("link");
-				child; child = child->next_sibling("link")) {
-				xml_attribute<>* compiler = child->first_attribute("compiler");
-				if (compiler != NULL) {
-					int target_compiler = check_compiler_str(compiler->value());
-					if (target_compiler == COMPILER)
-						f_output.extra_files = parse_string(build_compiler_string(child, '\0', 0, 0));
-				}
-			}
-			if (output_type == STR_APP) 
-				operation = OPERATION_LINK;
-			else if (output_type == STR_STATIC) 
-				operation = OPERATION_LIB;
+	//Calculate both the path and filename of the project.
+	string path_str;
+	string project_file;
+	//Set path_str to the path of the project file/project.
+	if(is_file && pos) {
+		path_str = project.substr(0, pos + 1);
+		project_file = project.substr(pos + 1, project.size());
+	}
+	else if(is_file) {
+		path_str = "";
+		project_file = project;
+	}
+	else {
+		path_str = project;
+		project_file = "project.xml";
+	}
 
-			
-			f_output.compiled_files = compiled_files;
-			f_output.output_name = output_name;
-			produce_output(f_output, operation, f);
+	//Change to the project's directory, if it has one.
+	char* path = pgetcwd();
+	if (!path_str.empty() && chdir(path_str.c_str()) != 0) {
+		printf("Error: %s could not be opened.\n", project.c_str());
+		free(path);
+		return 1;
+	}
+	int result = plan_project(project_file, plan);
+	chdir(path);
+	free(path);
+	if (result != LOAD_OK && result != LOAD_NO_PROJECT) {
+		fprintf(stderr, "Error: Loading project: %s failed.\n", project.c_str());
+		return 1;
+	}
+	return 0;
+}
 
+/**
+ * @brief plan_usage works out, once per project and variant, what a project
+ * takes from its dependencies and what it passes on to the projects that
+ * depend on it, through the whole dependency graph. A static library passes
+ * on the libraries it links with, since its archive doesn't hold them; an
+ * app or shared library was linked with them already.
+ * @param plan the project.
+ * @param usage set to the project's usage.
+ * @return 0 on success, non-zero if a dependency can't be loaded.
+ */
+int plan_usage(project_plan& plan, project_usage*& usage) {
+	usage = &plan.usages[VARIANT];
+	if (usage->computed) return 0;
+	if (usage->computing) {
+		fprintf(stderr, "Error: %s depends on itself.\n", plan.dir.c_str());
+		return 1;
+	}
+	phase_timer timer(PHASE_INCLUDES);
+	usage->computing = 1;
+	project_model& project = plan.models[VARIANT];
+	char* path = pgetcwd();
+	int error = chdir(plan.dir.c_str()) != 0;
+	for (size_t i = 0; !error && i < project.depends.size(); i++) {
+		const dependency& dep = project.depends[i];
+		project_plan* p = NULL;
+		project_usage* u = NULL;
+		if ((error = load_dependency(dep, p)) != 0 || p == NULL) continue;
+		if ((error = plan_usage(*p, u)) != 0) continue;
+		if (dep.link || dep.include) {
+			usage->dep_includes.insert(usage->dep_includes.end(), u->includes.begin(), u->includes.end());
+			usage->dep_flags.insert(usage->dep_flags.end(), u->flags.begin(), u->flags.end());
+		}
+		if (dep.link) {
+			usage->dep_libraries.insert(usage->dep_libraries.end(), u->libraries.begin(), u->libraries.end());
+			usage->dep_link_flags.insert(usage->dep_link_flags.end(), u->link_flags.begin(), u->link_flags.end());
 		}
 	}
-}
+	chdir(path);
+	free(path);
+	usage->computing = 0;
+	if (error) return error;
+	unique_paths(usage->dep_includes);
+	link_order(usage->dep_libraries);
+	unique_paths(usage->dep_flags);
+	unique_paths(usage->dep_link_flags);
 
-int step_compile_files(xml_node<>* project, string& compiled_files, sourcefile& base_file) {
-	//Process source files.
-	int error = 0;
-	for (xml_node<> *child = project->first_node("source");
-		child; child = child->next_sibling("source")) {
-		xml_attribute<>* out = child->first_attribute("out");
-		xml_attribute<>* f = child->first_attribute("f");
+	vector<string> own;
+	for (auto& include : project.includes) tokenize(include, own, ";", true);
+	for (auto& dir : own)
+		usage->includes.push_back(normalize_path(dir[0] == '/' ? dir : plan.dir + PATH_SEP + dir));
+	usage->includes.insert(usage->includes.end(), usage->dep_includes.begin(), usage->dep_includes.end());
+	unique_paths(usage->includes);
+	usage->flags = project.usage_flags;
+	usage->flags.insert(usage->flags.end(), usage->dep_flags.begin(), usage->dep_flags.end());
+	unique_paths(usage->flags);
 
-		string filename = (f != NULL ? string(f->value(), f->value_size()) :
-			string(child->value(), child->value_size()));
+	int is_static = project.output_type == STR_STATIC;
+	if ((is_static || project.output_type == STR_SHARED) && !project.sources.empty()) {
+		//MSVC links against a DLL's import library.
+		const string& output = project.output_type == STR_SHARED && COMPILER == COMPILER_MSVC ?
+			FLAGS.output_dir + PATH_SEP + project.output_name + ".lib" : project.output_file;
+		usage->libraries.push_back(normalize_path(plan.dir + PATH_SEP + output));
+	}
+	//Like its libraries, an archive passes its dependencies' link flags on.
+	usage->link_flags = project.usage_link_flags;
+	if (is_static) {
+		usage->libraries.insert(usage->libraries.end(), usage->dep_libraries.begin(), usage->dep_libraries.end());
+		usage->link_flags.insert(usage->link_flags.end(), usage->dep_link_flags.begin(), usage->dep_link_flags.end());
+	}
+	link_order(usage->libraries);
+	unique_paths(usage->link_flags);
+	usage->computed = 1;
+	return 0;
+}
 
-		if (filename.size() == 0) {
-			continue;
-		}
-		
-		if(!check_os(child))
-			continue;
-		
-		xml_attribute<>* arch = child->first_attribute("arch");
-		if(arch != NULL) {
-			string arch_str(arch->value(), arch->value_size());
-			if(arch_str != (FLAGS.arch.empty() ? DEFAULT_ARCH : FLAGS.arch)) 
-				continue;
-		}
+/**
+ * @brief step_build_dependencies plans the dependencies a project needs
+ * built, and returns what it takes from them.
+ * @param plan the project.
+ * @param start the action that waits for the dependencies.
+ * @param d_outputs set to the libraries to link, in link order.
+ * @param d_includes set to the include flags of the project and its
+ * dependencies, each dir once.
+ * @param d_flags set to the compile flags propagated by the dependencies.
+ * @param d_linker set to the link flags the libraries need (rpaths and
+ * propagated flags).
+ * @return 0 on success, non-zero if a dependency can't be planned.
+ */
+int step_build_dependencies(project_plan& plan, action* start, string& d_outputs,
+	string& d_includes, string& d_flags, string& d_linker) {
+	project_model& project = plan.models[VARIANT];
+	project_usage* usage = NULL;
+	int error = plan_usage(plan, usage);
+	if (error) return error;
 
-		string output;
-		if (out != NULL) output = filename;
-		else {
-			string immdir = (FLAGS.config.empty() ? DEFAULT_OUTPUT_DIR : FLAGS.config);
-			mkdir(immdir.c_str());
-			output = make_output_filename(immdir, filename);
-		}
+	//Dependencies' includes come before the project's own.
+	vector<string> includes = usage->dep_includes;
+	includes.insert(includes.end(), usage->includes.begin(), usage->includes.end());
+	unique_paths(includes);
+	for (auto& dir : includes)
+		d_includes += COMPILER_FLAG[COMPILER] + "I\"" + relative_path(plan.dir, dir) + "\" ";
+	for (auto& flags : usage->dep_flags) d_flags += flags + " ";
 
-		base_file.filename = filename;
-		base_file.output = output;
-		
-		//Check if output file exists, and is last modified before the input.
-		struct stat s_input, s_output;
-		if(stat(filename.c_str(), &s_input) < 0) {
-			printf("Error: %s could not be opened.\n", filename.c_str());
-			return 1; //Could not stat input file.
+	string output_dir = normalize_path(plan.dir + PATH_SEP + dir_name(project.output_file));
+	for (auto& library : usage->dep_libraries) {
+		string dir = dir_name(library);
+		d_outputs += relative_path(plan.dir, dir) + library.substr(dir.size()) + " ";
+		if (COMPILER == COMPILER_GCC && endsWith(library, OUTPUT_SHARED_EXT[COMPILER])) {
+			//Find the library relative to whatever links it, so the
+			//output trees can be moved.
+			string rpath = relative_path(output_dir, dir);
+#ifdef __APPLE__
+			d_linker += "'-Wl,-rpath,@loader_path/" + rpath + "' ";
+#else
+			d_linker += "'-Wl,-rpath,$ORIGIN/" + rpath + "' ";
+#endif
 		}
+	}
+	for (auto& flags : usage->dep_link_flags) d_linker += flags + " ";
 
-        if(stat(output.c_str(), &s_output) < 0 || s_output.st_mtime < s_input.st_mtime) {
-            if ((error = compile_file(&base_file)) != 0) {
-                return error; //Abort compilation.
-            }
-        }
-        compiled_files += output + " ";
-
+	//Dependencies are always planned, and so checked like this project: they
+	//only do work when something in them changed.
+	char* path = pgetcwd();
+	for (auto& dep : project.depends) {
+		project_plan* p = NULL;
+		if ((error = load_dependency(dep, p)) != 0) break;
+		if (p == NULL) continue;
+		//Build the project before this one.
+		action* done = NULL;
+		chdir(p->dir.c_str());
+		error = plan_build(*p, done);
+		chdir(path);
+		if (error) break;
+		add_edge(done, start);
 	}
+	free(path);
 	return error;
 }
 
-void add_flags(build_flags& flags, xml_node<>* child, char prefix, int quote) {
-	string* target_flags = &flags.compiler_flags;
-	xml_attribute<>* step = child->first_attribute("step");
-	
-	if (step != NULL && strcmp("link", step->value()) == 0) 
-		target_flags = &flags.linker_flags;
-	
-	xml_attribute<>* ext = child->first_attribute("ext");
-	if(ext != NULL) {
-		string ext_str = string(ext->value(), ext->value_size());
-		string flag_str = parse_string(build_compiler_string(child, prefix, quote));
-		vector<string> exts;
-		tokenize(ext_str, exts, ";", true);
-		for(auto ext: exts) {
-			//Combine any existing flags for this extension.
-			string combined_flags = "";
-			auto it = flags.ext_flags.find(ext);
-			if(it != flags.ext_flags.end()) {
-				combined_flags = it->second;
-				flags.ext_flags.erase(it);
-			}
-			combined_flags += flag_str;
-			flags.ext_flags.insert(make_pair(ext, combined_flags)); 
-		}
-		
-	} else 
-		*target_flags += parse_string(build_compiler_string(child, prefix, quote));
+/**
+ * @brief step_action returns the action for a prebuild or generate step. A
+ * step with the same command in the same directory (one that doesn't depend
+ * on the variant) is shared by every variant.
+ * @param dir the project directory.
+ * @param command the step.
+ * @param dirs directories already created for outputs.
+ */
+action* step_action(const string& dir, const command_step& command, unordered_set<string>& dirs) {
+	action*& step = GRAPH.steps[dir + "\n" + command.command];
+	if (step != NULL) return step;
+	step = GRAPH.add(dir);
+	step->command = command.command;
+	step->inputs = command.inputs;
+	step->outputs = command.outputs;
+	//Without declared outputs there's nothing to check, so run it.
+	step->always = command.outputs.empty();
+	if (!step->always) {
+		uint64_t hash = hash_string(command.command);
+		for (auto& output : command.outputs) hash = hash_string(output, hash);
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.stamp", (unsigned long long) hash);
+		step->stamp = CACHE_DIR + PATH_SEP + name;
+		mkdir(CACHE_DIR.c_str());
+		for (auto& output : command.outputs) make_dirs(dirs, output);
+	}
+	return step;
 }
 
-void step_add_flags(xml_node<>* project, build_flags& flags) {
-	//Add flags.
-	for (xml_node<> *child = project->first_node("flags");
-		child; child = child->next_sibling("flags")) {
-		xml_attribute<>* compiler = child->first_attribute("compiler");
-		xml_attribute<>* config = child->first_attribute("config");
-		
-		if (config != NULL) {
-			if (FLAGS.config != string(config->value(), config->value_size())) {
-				continue; //Not matching config, ignore flags.
-			}
-		}
-		
-		if(!check_os(child)) continue;
+/**
+ * module_info is what a source provides and imports as a C++20 module unit.
+ */
+struct module_info {
+	vector<string> provides;
+	vector<string> imports;
+};
 
-		xml_attribute<>* type = child->first_attribute("type");
-		char prefix = '\0';
-		int quote = 0;
-		if (type != NULL) {
-			if (strncmp(type->value(), "pp", 2) == 0) {
-				//Preprocessor flags.
-				prefix = 'D';
-				quote = 1;
+/**
+ * @brief lex_modules finds the module declarations and imports of a source:
+ * "export module m;", "module m:part;", "import m;", "import :part;".
+ * An implementation unit ("module m;") imports its interface. Header units
+ * aren't supported and are skipped.
+ * @param p the source.
+ * @param end the end of the source.
+ * @param info filled with the names.
+ */
+void lex_modules(const char* p, const char* end, module_info& info) {
+	string module;
+	while (p < end) {
+		const char* line_end = (const char*) memchr(p, '\n', end - p);
+		if (line_end == NULL) line_end = end;
+		while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+		auto word = [&p, line_end]() {
+			while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+			const char* start = p;
+			while (p < line_end && (isalnum((unsigned char) *p) || *p == '_' || *p == '.' || *p == ':')) p++;
+			return string(start, p - start);
+		};
+		string w = word();
+		int exported = w == "export";
+		if (exported) w = word();
+		if (w == "module") {
+			string name = word();
+			if (!name.empty()) {
+				size_t colon = name.find(':');
+				module = name.substr(0, colon);
+				if (exported || colon != string::npos) info.provides.push_back(name);
+				else info.imports.push_back(name);
 			}
 		}
-	
-		if (compiler != NULL) {
-			//Compiler specific flags.
-			int target_compiler = check_compiler_str(compiler->value());
-			if (target_compiler != COMPILER) {
-				continue;
-			}
+		else if (w == "import") {
+			string name = word();
+			if (!name.empty()) info.imports.push_back(name[0] == ':' ? module + name : name);
 		}
-		
-		//All checks passed. Add the flag.
-		add_flags(flags, child, prefix, quote);
+		p = line_end + 1;
 	}
 }
 
-void build_includes(xml_node<>* project, const string& dir, string& output) {
-	//Includes: Split by ; then produce separate include flags.
-	for (xml_node<> *child = project->first_node("include");
-		child; child = child->next_sibling("include")) {
-
-		if(!check_os(child))
-			continue;
-
-		output += build_compiler_string(child, 'I', 1, 1, dir);
-	
+/**
+ * @brief p1689_names collects the logical-name values of the "provides" or
+ * "requires" array of a P1689 dependency file.
+ * @param json the dependency file.
+ * @param key "provides" or "requires".
+ * @param names the names, appended to.
+ */
+void p1689_names(const string& json, const char* key, vector<string>& names) {
+	size_t pos = json.find(string("\"") + key + "\"");
+	if (pos == string::npos || (pos = json.find('[', pos)) == string::npos) return;
+	const string logical = "\"logical-name\"";
+	int depth = 0;
+	for (size_t i = pos; i < json.size(); i++) {
+		char c = json[i];
+		if (c == '"') {
+			int is_name = json.compare(i, logical.size(), logical) == 0;
+			for (i++; i < json.size() && json[i] != '"'; i++)
+				if (json[i] == '\\') i++;
+			if (!is_name) continue;
+			while (i + 1 < json.size() && json[i + 1] != '"') i++;
+			string name;
+			for (i += 2; i < json.size() && json[i] != '"'; i++) {
+				if (json[i] == '\\') i++;
+				name += json[i];
+			}
+			names.push_back(name);
+		}
+		else if (c == '[' || c == '{') depth++;
+		else if ((c == ']' || c == '}') && --depth == 0) return;
 	}
 }
 
-//Forward define build_project to allow dependent projects to call it.
-int build_project(xml_node<>* project);
+/**
+ * @brief module_cmi returns the compiled interface of a module in a project's
+ * output: output/<variant>/gcm/m-part.gcm for m:part.
+ */
+string module_cmi(const string& immdir, string name) {
+	for (auto& c : name) if (c == ':') c = '-';
+	return immdir + PATH_SEP "gcm" PATH_SEP + name + ".gcm";
+}
 
-int step_build_dependencies(xml_node<>* project, string& d_outputs, string& d_includes) {
-	char* path = NULL;
-	int error = 0;
-	for (xml_node<> *child = project->first_node("depends");
-		child; child = child->next_sibling("depends")) {
-		
-		if(!check_os(child))
-			continue;
+/**
+ * module_scan is the module resolution of one project's compiles in one
+ * variant. Its action runs once the sources have been scanned, after the
+ * prebuild and generate steps, and adds the order between the compiles the
+ * scans found (like a ninja dyndep); every C++ compile waits for it.
+ */
+struct module_scan {
+	string kind; //STR_MODULES_P1689 or STR_MODULES_BUILTIN.
+	string immdir;
+	string mapper; //The module mapper, relative to the project.
+	vector<string> sources;
+	vector<action*> compiles;
+};
 
-		path = pgetcwd();
-		xml_attribute<>* link = child->first_attribute("link");
-		bool do_link = false;
-		if (link != NULL && strcmp(link->value(), "true") == 0) {
-			do_link = true;
+static deque<module_scan> MODULE_SCANS;
+
+/**
+ * @brief resolve_modules runs a module_scan's action: it reads what each
+ * source provides and imports, from its P1689 file or with the built-in
+ * lexer, writes the module mapper, and leaves the edges from each provider
+ * to its importers in the action for the job pool to add.
+ * @param a the module_scan's action.
+ * @return 0 on success, non-zero if a source's modules can't be read.
+ */
+int resolve_modules(action& a) {
+	module_scan& m = *a.modules;
+	vector<module_info> infos(m.compiles.size());
+	for (size_t i = 0; i < m.compiles.size(); i++) {
+		const string& object = m.compiles[i]->outputs[0];
+		string path = action_path(a, m.kind == STR_MODULES_BUILTIN ? m.sources[i] : object + ".ddi");
+		mapped_file file;
+		struct stat s;
+		if (stat_file(path.c_str(), &s) < 0 || !load_project(path.c_str(), file)) {
+			//In safe mode the scan hasn't run (or the source been generated).
+			if (FLAGS.safemode) continue;
+			fprintf(stderr, "Error: Could not read the modules of %s.\n", m.sources[i].c_str());
+			return 1;
 		}
-		
-		xml_attribute<>* include = child->first_attribute("include");
-		bool do_include = false;
-		if(include != NULL && strcmp(include->value(), "true") == 0) {
-			do_include = true;
-		}
-
-		string project = string(child->value(), child->value_size());
-		struct stat dependency;
-		if(stat(project.c_str(), &dependency) < 0) {
-			printf("Error: %s could not be opened.\n", project.c_str());
-			return 1; //Could not stat input file.
-		}
-		int is_file = !((dependency.st_mode & S_IFDIR) == S_IFDIR);
-		//Determine if the project is in a different directory. (contains /)
-		size_t pos = project.find_last_of('/');
-		if (pos == string::npos) pos = 0;
-		
-		//Calculate both the path and filename of the project.
-		string path_str;
-		string project_file;
-		//Set path_str to the path of the project file/project.
-		if(is_file && pos) {
-			path_str = project.substr(0, pos + 1);
-			project_file = project.substr(pos + 1, project.size());
-		}
-		else if(is_file) {
-			path_str = "";
-			project_file = project;
+		if (m.kind == STR_MODULES_BUILTIN) {
+			lex_modules(file.data, file.data + file.size, infos[i]);
 		}
 		else {
-			path_str = project;
-			project_file = "project.xml";
-		}
-
-		//TODO: Prevent stack overflow (project including same project).
-		//If there is a '/' in the project, we need to change directories.
-		if(pos) chdir(path_str.c_str());
-		char* root_project = NULL;
-		if ((root_project = load_project(project_file.c_str()))) {
-			//Root project loaded. Parse xml.
-			xml_document<> doc;
-			try{
-				doc.parse<0>(root_project);
-			}
-			catch (rapidxml::parse_error ex) {
-				fprintf(stderr, "Error: Unable to parse dependent project.\n");
+			string json(file.data, file.size);
+			p1689_names(json, "provides", infos[i].provides);
+			p1689_names(json, "requires", infos[i].imports);
+		}
+		unload_project(file);
+	}
+
+	unordered_map<string, size_t> providers;
+	string mapper = "$root " + a.cwd + "\n";
+	for (size_t i = 0; i < infos.size(); i++) {
+		for (auto& name : infos[i].provides) {
+			if (!providers.insert(make_pair(name, i)).second) {
+				fprintf(stderr, "Error: Module %s is provided by both %s and %s.\n", name.c_str(),
+					m.sources[providers[name]].c_str(), m.sources[i].c_str());
 				return 1;
 			}
-			xml_node<>* p = doc.first_node("project");
-			if (p != NULL) {
-				//We have loaded a valid project.
-				//Send the project information (dependencies etc) up the chain.
-				xml_node<>* output = p->first_node("output");
-				string output_file = get_output_file(output);
-				//If dependency should be linked, add it to the dependency outputs.
-				if (do_link) {
-					d_outputs += path_str + PATH_SEP + output_file + " ";
-				}
-				
-				if (do_link || do_include) {
-					//Send expanded includes to projects that depend on this one.
-					build_includes(p, path_str + "/", d_includes);	
-				}
+			string cmi = module_cmi(m.immdir, name);
+			m.compiles[i]->outputs.push_back(cmi);
+			mapper += name + " " + cmi + "\n";
+		}
+	}
+	for (size_t i = 0; i < infos.size(); i++) {
+		for (auto& name : infos[i].imports) {
+			//Modules from elsewhere (std, other projects) are left to the compiler.
+			auto provider = providers.find(name);
+			if (provider == providers.end() || provider->second == i) continue;
+			a.edges.push_back(make_pair(m.compiles[provider->second], m.compiles[i]));
+			m.compiles[i]->optional_inputs.push_back(module_cmi(m.immdir, name));
+		}
+	}
+	if (FLAGS.safemode) return 0;
 
-				FILE* ofile;
-				if ((ofile = fopen(output_file.c_str(), "r")) != NULL) {
-					fclose(ofile);
-				} else {
-					//Build the project.
-					error = build_project(p);
-				}
-			}
-			delete[] root_project;
+	string path = action_path(a, m.mapper);
+	FILE* fp = fopen(path.c_str(), "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: Could not write %s.\n", path.c_str());
+		return 1;
+	}
+	fwrite(mapper.data(), 1, mapper.size(), fp);
+	fclose(fp);
+	return 0;
+}
+
+/**
+ * @brief plan_modules adds the steps ordering a project's compiles by the
+ * C++20 modules they provide and import: a scan of each C++ source with the
+ * compiler (P1689, gcc 14 or later), run once the prebuild and generate
+ * steps are done, and the module_scan action reading the results (or, with
+ * the built-in lexer, the sources themselves) before any C++ compile starts.
+ * @param plan the project.
+ * @param file the project's compile settings.
+ * @param immdir the directory the objects go in.
+ * @param headers the action every compile waits for.
+ * @param generated the generate step of each generated source, if any.
+ * @param compiles the compile of each source, NULL for prebuilt ones.
+ */
+void plan_modules(project_plan& plan, sourcefile& file, const string& immdir, action* headers,
+	unordered_map<string, action*>& generated, vector<action*>& compiles) {
+	project_model& project = plan.models[VARIANT];
+	MODULE_SCANS.push_back(module_scan());
+	module_scan& m = MODULE_SCANS.back();
+	m.kind = project.modules;
+	m.immdir = immdir;
+	m.mapper = file.modules;
+	make_dirs(file.dirs, module_cmi(immdir, "m"));
+	action* resolve = GRAPH.add(plan.dir);
+	resolve->modules = &m;
+	add_edge(headers, resolve);
+	for (size_t i = 0; i < project.sources.size(); i++) {
+		action* compile = compiles[i];
+		if (compile == NULL || !is_cxx_source(project.sources[i].filename)) continue;
+		m.sources.push_back(project.sources[i].filename);
+		m.compiles.push_back(compile);
+		add_edge(resolve, compile);
+		action* step = generated[project.sources[i].filename];
+		if (m.kind == STR_MODULES_BUILTIN) {
+			if (step != NULL) add_edge(step, resolve);
+			continue;
 		}
-		else {
-		      fprintf(stderr, "Error: Loading project: %s failed.\n", project.c_str());
-			return 1;
+		const string& object = compile->outputs[0];
+		file.filename = project.sources[i].filename;
+		action* scan = GRAPH.add(plan.dir);
+		scan->command = command_prefix(&file) + COMPILER_MODULE_SCAN[COMPILER] + object + ".ddi" +
+			" -fdeps-target=" + object + " -o " + object + ".ii " + file.filename;
+		scan->toolchain = TOOLCHAINS.fingerprint(scan->command);
+		scan->inputs.push_back(file.filename);
+		scan->outputs.push_back(object + ".ddi");
+		scan->scan = compile->scan;
+		if (compile->scan == NULL && !compile->depfile.empty()) scan->depfile = object + ".d";
+		add_edge(headers, scan);
+		if (step != NULL) add_edge(step, scan);
+		add_edge(scan, resolve);
+	}
+}
+
+/**
+ * @brief plan_compiles adds a compile action for each of a project's sources.
+ * @param plan the project.
+ * @param file the project's includes and flags, reused for each source.
+ * @param immdir the directory the objects go in.
+ * @param headers the action every compile waits for.
+ * @param generated the generate step of each generated source, if any.
+ * @param compiled the action that waits for every compile.
+ * @param compiled_files set to the objects and prebuilt sources, space
+ * separated.
+ * @return 0 on success, non-zero if the compiles can't be planned.
+ */
+int plan_compiles(project_plan& plan, sourcefile& file, const string& immdir, action* headers,
+	unordered_map<string, action*>& generated, action* compiled, string& compiled_files) {
+	project_model& project = plan.models[VARIANT];
+	scan_context* scan = NULL;
+	if (FLAGS.scan) {
+		GRAPH.scans.push_back(scan_context());
+		scan = &GRAPH.scans.back();
+		scan->dirs = include_dirs(file.includes, plan.dir);
+		for (auto& dir : scan->dirs) scan->key += dir + "\n";
+	}
+	int modules = !project.modules.empty() && COMPILER == COMPILER_GCC;
+	if (!project.modules.empty() && !modules)
+		fprintf(stderr, "Warning: C++20 modules are only supported with gcc, ignored in %s.\n", plan.dir.c_str());
+	if (modules) {
+		file.modules = immdir + PATH_SEP "modules.map";
+		make_dirs(file.dirs, file.modules);
+	}
+	vector<action*> compiles;
+	for (auto& source : project.sources) {
+		if (source.prebuilt) {
+			compiled_files += source.filename + " ";
+			compiles.push_back(NULL);
+			continue;
 		}
-		chdir(path);
-		free(path);
+		file.filename = source.filename;
+		file.output = make_output_filename(immdir, source.filename);
+		make_dirs(file.dirs, file.output);
+		compile_command(&file, file.command);
+
+		action* compile = GRAPH.add(plan.dir);
+		compile->command = file.command;
+		compile->toolchain = TOOLCHAINS.fingerprint(file.command);
+		compile->inputs.push_back(file.filename);
+		compile->outputs.push_back(file.output);
+		if (scan != NULL) compile->scan = scan;
+		else if (!COMPILER_DEPFILE[COMPILER].empty()) compile->depfile = depfile_filename(file.output);
+		if (file.pgo == PGO_USE) {
+			//Recompile when the object's profile changes. Sources the
+			//training run never reached have none.
+			compile->optional_inputs.push_back(profile_filename(file.output));
+		}
+		add_edge(headers, compile);
+		action* step = generated[source.filename];
+		if (step != NULL) add_edge(step, compile);
+		add_edge(compile, compiled);
+		compiled_files += file.output + " ";
+		compiles.push_back(compile);
 	}
-	return error;
+	if (modules) plan_modules(plan, file, immdir, headers, generated, compiles);
+	return 0;
+}
+
+/**
+ * @brief plan_link adds the action producing a project's output.
+ * @param plan the project.
+ * @param f_output the objects, extra files and name of the output.
+ * @param operation OPERATION_LINK, OPERATION_LIB or OPERATION_SHARED.
+ * @param file the project's compile settings.
+ * @param compiled the action that waits for the objects.
+ * @return the link action.
+ */
+action* plan_link(project_plan& plan, output& f_output, int operation, sourcefile& file, action* compiled) {
+	project_model& project = plan.models[VARIANT];
+	make_dirs(file.dirs, f_output.output_name);
+
+	action* link = GRAPH.add(plan.dir);
+	link_command(f_output, operation, &project.flags, link->response);
+	link->command = OPERATIONS[operation]->at(COMPILER);
+	if (operation == OPERATION_LIB && file.lto && COMPILER == COMPILER_GCC) {
+		//Archives of LTO objects need the plugin's symbol index.
+		link->command = "gcc-" + link->command;
+	}
+	link->toolchain = TOOLCHAINS.fingerprint(link->command);
+	//Relinked when an object or a dependency's library changed (or the
+	//command did), not on every build.
+	tokenize(f_output.compiled_files, link->inputs, " ", true);
+	link->outputs.push_back(f_output.output_name);
+#ifndef NO_RESPONSE_FILE
+	link->response_file = f_output.output_name + ".rsp";
+	link->command += " @" + link->response_file;
+#else
+	link->command += " " + link->response;
+	link->response.clear();
+#endif
+	add_edge(compiled, link);
+	return link;
 }
 
+/**
+ * @brief plan_training adds the steps producing a program's profiles: its
+ * sources are compiled and linked instrumented into
+ * output/<variant>-instrumented, the <pgo> command is run, and the profiles
+ * it writes are copied next to the objects of the variant that use them.
+ * @param plan the project.
+ * @param base_file the project's compile settings.
+ * @param headers the action every compile waits for.
+ * @param generated the generate step of each generated source, if any.
+ * @param d_outputs the dependencies' outputs to link.
+ * @param d_linker the dependencies' link flags.
+ * @return the action the optimised compiles wait for, NULL if the project
+ * can't be trained.
+ */
+action* plan_training(project_plan& plan, const sourcefile& base_file, action* headers,
+	unordered_map<string, action*>& generated, const string& d_outputs, const string& d_linker) {
+	project_model& project = plan.models[VARIANT];
+	if (project.output_type != STR_APP || COMPILER != COMPILER_GCC) {
+		fprintf(stderr, "Warning: <pgo> needs an app output built with gcc, ignored in %s.\n",
+			plan.dir.c_str());
+		return NULL;
+	}
+	string immdir = FLAGS.output_dir + "-instrumented";
+	sourcefile file = base_file;
+	file.pgo = PGO_GENERATE;
+	action* compiled = GRAPH.add(plan.dir);
+	string objects;
+	if (plan_compiles(plan, file, immdir, headers, generated, compiled, objects) != 0) return NULL;
+
+	output f_output;
+	f_output.extra_files = project.link_files + " " + d_linker + " " + COMPILER_PGO_GENERATE[COMPILER];
+	f_output.compiled_files = objects + d_outputs;
+	size_t slash = project.output_file.find_last_of('/');
+	f_output.output_name = immdir + PATH_SEP + project.output_file.substr(slash == string::npos ? 0 : slash + 1);
+	//Relinked (and so retrained) only when an object changed.
+	action* link = plan_link(plan, f_output, OPERATION_LINK, file, compiled);
 
+	//Drop the counts of the last run, so they aren't merged into this one.
+	string remove = "rm -f";
+	string collect;
+	for (auto& source : project.sources) {
+		if (source.prebuilt) continue;
+		string from = profile_filename(make_output_filename(immdir, source.filename));
+		string to = profile_filename(make_output_filename(FLAGS.output_dir, source.filename));
+		make_dirs(file.dirs, to);
+		remove += " " + from;
+		//Only copy changed profiles, so the others don't cause recompiles.
+		collect += " && { if [ -f " + from + " ]; then cmp -s " + from + " " + to +
+			" || cp " + from + " " + to + "; else rm -f " + to + "; fi; }";
+	}
+	action* train = GRAPH.add(plan.dir);
+	train->command = remove + " && " + rule_replace(project.pgo, f_output.output_name, EMPTY_STR, EMPTY_STR) + collect;
+	train->inputs.push_back(f_output.output_name);
+	//Trained again whenever the instrumented program is relinked.
+	train->outputs.push_back(immdir + PATH_SEP "trained");
+	train->stamp = train->outputs.back();
+	add_edge(link, train);
+	return train;
+}
 
-int build_project(xml_node<>* project) {
+/**
+ * @brief plan_build adds the actions building a project in the active variant
+ * to the build graph: its dependencies, then its prebuild commands in order,
+ * then its generate steps, then its sources, then its output. The current
+ * directory must be the project's.
+ * @param plan the project.
+ * @param done set to the action that finishes the project.
+ * @return 0 on success, non-zero if the project can't be planned.
+ */
+int plan_build(project_plan& plan, action*& done) {
+	if ((done = plan.done[VARIANT]) != NULL) return 0;
+	if (plan.planning[VARIANT]) {
+		fprintf(stderr, "Error: %s depends on itself.\n", plan.dir.c_str());
+		return 1;
+	}
+	plan.planning[VARIANT] = 1;
+	project_model& project = plan.models[VARIANT];
 	string d_outputs;
 	string d_includes;
+	string d_flags;
+	string d_linker;
 	int error = 0;
 
+	action* start = GRAPH.add(plan.dir);
 	if ((error = step_build_dependencies(
-					project, d_outputs, d_includes)) != 0) return error;
+					plan, start, d_outputs, d_includes, d_flags, d_linker)) != 0) return error;
 
 	//Run any prebuild commands before commencing the build.
-	for (xml_node<>* child = project->first_node("prebuild");
-		child; child = child->next_sibling("prebuild")) {
-		if(!check_os(child))
-			continue;
-
-		string parsed_command = parse_string(string(child->value(), child->value_size()));
+	action* last = start;
+	unordered_set<string> dirs;
+	for (auto& prebuild : project.prebuild) {
+		action* step = step_action(plan.dir, prebuild, dirs);
+		add_edge(last, step);
+		last = step;
+	}
 
-		if ((error = run_command(parsed_command.c_str()) != 0))
-			return error;
+	//Generate steps run in parallel after the prebuild commands. A generated
+	//source is compiled as soon as its own step is done; other generated
+	//files (headers) are waited for by every compile.
+	unordered_map<string, action*> generated;
+	for (auto& source : project.sources) generated[source.filename] = NULL;
+	action* headers = last;
+	if (!project.generate.empty()) {
+		headers = GRAPH.add(plan.dir);
+		add_edge(last, headers);
+	}
+	for (auto& generate : project.generate) {
+		action* step = step_action(plan.dir, generate, dirs);
+		add_edge(last, step);
+		int header = 0;
+		for (auto& output : generate.outputs) {
+			auto source = generated.find(output);
+			if (source != generated.end()) source->second = step;
+			else header = 1;
+		}
+		if (header) add_edge(step, headers);
 	}
 
 	sourcefile base_file;
-	build_flags flags;
-	string compiled_files = "";
 
-	base_file.flags = &flags;
+	base_file.flags = &project.flags;
+	base_file.pic = project.output_type == STR_SHARED;
+	base_file.lto = !project.lto.empty();
 	base_file.includes = d_includes;
-	build_includes(project, "", base_file.includes);
+	base_file.dep_flags = d_flags;
+	for (auto& kv : project.flags.ext_flags)
+		if (kv.first.find('.') != string::npos) base_file.dotted_exts = 1;
+
+	//Profile-guided optimisation: the sources are compiled once the training
+	//run has written their profiles.
+	if (!project.pgo.empty()) {
+		action* trained = plan_training(plan, base_file, headers, generated, d_outputs, d_linker);
+		if (trained != NULL) {
+			base_file.pgo = PGO_USE;
+			headers = trained;
+		}
+	}
 
-	step_add_flags(project, flags);
+	//Process source files.
+	action* compiled = GRAPH.add(plan.dir);
+	string compiled_files;
+	if ((error = plan_compiles(plan, base_file, FLAGS.output_dir, headers, generated, compiled,
+		compiled_files)) != 0) return error;
+	done = compiled;
 
-	if ((error = step_compile_files(project, compiled_files, base_file) != 0)) return error;
+	//Produce output (link/lib...). Archives don't take the libraries they
+	//use; those are passed on to whatever links the archive.
+	if (project.output_type != STR_STATIC) compiled_files += d_outputs;
+	if (!project.output_type.empty() && compiled_files.length() > 0) {
+		int operation = -1;
+		if (project.output_type == STR_APP) 
+			operation = OPERATION_LINK;
+		else if (project.output_type == STR_STATIC) 
+			operation = OPERATION_LIB;
+		else if (project.output_type == STR_SHARED) 
+			operation = OPERATION_SHARED;
 
-	compiled_files += d_outputs;
-	step_build_output(project, compiled_files, &flags);
-	
+		if (operation != -1) {
+			output f_output;
+			f_output.extra_files = project.link_files;
+			if (operation != OPERATION_LIB) f_output.extra_files += " " + d_linker;
+			f_output.compiled_files = compiled_files;
+			f_output.output_name = project.output_file;
+			f_output.lto = project.lto;
+			f_output.lto_cache = project.lto_cache;
+			if (project.lto_cache) mkdir((FLAGS.output_dir + PATH_SEP "lto-cache").c_str());
+			done = plan_link(plan, f_output, operation, base_file, compiled);
+		}
+	}
+	plan.done[VARIANT] = done;
+	plan.planning[VARIANT] = 0;
 	return error;
 }
 
+/**
+ * @brief find_target resolves a target named on the command line: a project
+ * path (a directory or project file, as in <depends>), or the name of an
+ * output built in the root project's dependency graph ("net" or "libnet.a").
+ * @param root the root project.
+ * @param name the target.
+ * @param target set to the target's project.
+ * @return 0 on success, non-zero if there's no such target.
+ */
+int find_target(project_plan& root, const string& name, project_plan*& target) {
+	target = NULL;
+	struct stat s;
+	if (stat_file(name.c_str(), &s) == 0) {
+		dependency dep;
+		dep.path = name;
+		if (load_dependency(dep, target) != 0) return 1;
+		if (target == NULL) {
+			fprintf(stderr, "Error: %s has no project file.\n", name.c_str());
+			return 1;
+		}
+		return 0;
+	}
+	//Loads every project the root depends on.
+	project_usage* usage = NULL;
+	if (plan_usage(root, usage) != 0) return 1;
+	auto base_name = [](const string& path) {
+		size_t slash = path.find_last_of('/');
+		return slash == string::npos ? path : path.substr(slash + 1);
+	};
+	for (auto& plan : PLAN_STORE) {
+		project_model& model = plan.models[VARIANT];
+		if (model.output_type.empty() ||
+			(base_name(model.output_name) != name && base_name(model.output_file) != name)) continue;
+		if (target != NULL) {
+			fprintf(stderr, "Error: %s is built by both %s and %s.\n", name.c_str(),
+				target->dir.c_str(), plan.dir.c_str());
+			return 1;
+		}
+		target = &plan;
+	}
+	if (target == NULL) {
+		fprintf(stderr, "Error: No project builds %s.\n", name.c_str());
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief list_files appends the regular files under a directory, recursively.
+ */
+void list_files(const string& dir, vector<string>& files) {
+#ifdef _MSC_VER
+	struct _finddata_t entry;
+	intptr_t handle = _findfirst((dir + PATH_SEP "*").c_str(), &entry);
+	if (handle == -1) return;
+	do {
+		string name = entry.name;
+		if (name == "." || name == "..") continue;
+		if (entry.attrib & _A_SUBDIR) list_files(dir + PATH_SEP + name, files);
+		else files.push_back(dir + PATH_SEP + name);
+	} while (_findnext(handle, &entry) == 0);
+	_findclose(handle);
+#else
+	DIR* d = opendir(dir.c_str());
+	if (d == NULL) return;
+	struct dirent* entry;
+	while ((entry = readdir(d)) != NULL) {
+		string name = entry->d_name;
+		if (name == "." || name == "..") continue;
+		string path = dir + PATH_SEP + name;
+		struct stat s;
+		if (stat_file(path.c_str(), &s) < 0) continue;
+		if ((s.st_mode & S_IFMT) == S_IFDIR) list_files(path, files);
+		else if ((s.st_mode & S_IFMT) == S_IFREG) files.push_back(path);
+	}
+	closedir(d);
+#endif
+}
+
+/**
+ * @brief collect_garbage deletes what earlier builds left in the output trees
+ * of this run's projects and variants that no action uses any more: the
+ * objects of removed sources, with their depfiles, profiles and module scans,
+ * and renamed outputs. Candidates are the command log's entries, and with
+ * sweep also every object found under the output trees. The log entries of
+ * deleted files are dropped. Other variants' trees are left alone.
+ * @param sweep walk the output trees too (--gc).
+ */
+void collect_garbage(int sweep) {
+	unordered_set<string> live;
+	for (auto& a : GRAPH.actions) {
+		for (auto& file : a.inputs) live.insert(normalize_path(action_path(a, file)));
+		for (auto& file : a.optional_inputs) live.insert(normalize_path(action_path(a, file)));
+		for (auto& file : a.outputs) live.insert(normalize_path(action_path(a, file)));
+	}
+	vector<string> trees;
+	size_t variant = VARIANT;
+	for (auto& plan : PLAN_STORE) {
+		for (size_t i = 0; i < VARIANTS.size(); i++) {
+			//Projects loaded but not built in this run keep their outputs.
+			if (plan.done[i] == NULL) continue;
+			use_variant(i);
+			string tree = normalize_path(plan.dir + PATH_SEP + FLAGS.output_dir);
+			trees.push_back(tree);
+			trees.push_back(tree + "-instrumented");
+		}
+	}
+	use_variant(variant);
+	auto in_trees = [&trees](const string& path) {
+		for (auto& tree : trees)
+			if (path.size() > tree.size() && path.compare(0, tree.size(), tree) == 0 && path[tree.size()] == '/')
+				return true;
+		return false;
+	};
+
+	vector<string> stale;
+	unordered_set<string> logged;
+	for (auto& kv : COMMANDS.entries) {
+		string path = normalize_path(kv.first);
+		logged.insert(path);
+		if (!live.count(path) && in_trees(path)) stale.push_back(kv.first);
+	}
+	if (sweep) {
+		for (auto& tree : trees) {
+			vector<string> files;
+			list_files(tree, files);
+			for (auto& file : files) {
+				string path = normalize_path(file);
+				if (endsWith(path, DEFAULT_OUTPUT_SUFFIX) && !live.count(path) && !logged.count(path))
+					stale.push_back(file);
+			}
+		}
+	}
+
+	for (auto& output : stale) {
+		vector<string> files(1, output);
+		if (endsWith(output, DEFAULT_OUTPUT_SUFFIX)) {
+			files.push_back(depfile_filename(output));
+			files.push_back(profile_filename(output));
+			files.push_back(output + ".ddi");
+			files.push_back(output + ".ii");
+			files.push_back(output + ".d"); //The module scan's depfile.
+		}
+		for (auto& file : files) {
+			struct stat s;
+			if (stat_file(file.c_str(), &s) < 0) continue;
+			printf("Removing %s\n", file.c_str());
+			if (!FLAGS.safemode) unlink(file.c_str());
+		}
+		if (!FLAGS.safemode) COMMANDS.forget(output);
+	}
+}
+
+//The benchmarks include this file for its functions.
+#ifndef UNBUILD_NO_MAIN
 int main(int argc, char** argv) {
+	PROFILE.start = chrono::steady_clock::now();
 	char* path = NULL;
+	vector<string> configs;
+	vector<string> archs;
+	vector<string> target_names;
 	if (argc == 1) {
 bad_format:
-		fprintf(stderr, "Usage: unbuild compiler [path [options]]\n");
+		fprintf(stderr, "Usage: unbuild compiler [path [options] [targets]]\n");
 		return 1;
 	}
 
@@ -767,16 +4054,48 @@ bad_format:
 					FLAGS.safemode = 1;
 					break;
 				case 'c':
-					FLAGS.config = string(arg + 2);
+					//May be given more than once.
+					configs.push_back(string(arg + 2));
 					break;
 				case 'm':
-					FLAGS.arch = string(arg + 2);
+					archs.push_back(string(arg + 2));
+					break;
+				case 'j':
+					//Parallel jobs. Defaults to the detected cpu/cgroup limit.
+					FLAGS.jobs = atoi(arg + 2);
+					if (FLAGS.jobs < 1) goto bad_format;
+					break;
+				case 'v':
+					FLAGS.verbose = 1;
+					break;
+				case '-':
+					//Long switches.
+					if (strcmp(arg + 2, "stream") == 0) {
+						//Always use the streaming project reader.
+						FLAGS.stream = 1;
+					}
+					else if (strcmp(arg + 2, "scan-includes") == 0) {
+						//Find headers with the built in scanner.
+						FLAGS.scan = 1;
+					}
+					else if (strcmp(arg + 2, "gc") == 0) {
+						//Delete stale objects from the output trees.
+						FLAGS.gc = 1;
+					}
+					else if (strcmp(arg + 2, "profile") == 0) {
+						//Print where unbuild's own time went.
+						FLAGS.profile = 1;
+					}
+					else goto bad_format;
 					break;
 				default:
 					goto bad_format;
 				}
 			}
-			else goto bad_format;
+			else {
+				//Build only this project or output, and what it needs.
+				target_names.push_back(string(arg));
+			}
 		}
 	}
 
@@ -793,31 +4112,87 @@ bad_format:
 
 	if (COMPILER == -1) goto bad_format;
 
+	//Build every config for every arch.
+	if (configs.empty()) configs.push_back(EMPTY_STR);
+	if (archs.empty()) archs.push_back(EMPTY_STR);
+	for (auto& config : configs) {
+		for (auto& arch : archs) {
+			build_variant v;
+			v.config = config;
+			v.arch = arch;
+			VARIANTS.push_back(v);
+		}
+	}
+	use_variant(0);
+
+	if (FLAGS.jobs == 0) FLAGS.jobs = detect_jobs();
+	else if (FLAGS.verbose) printf("Using %d jobs.\n", FLAGS.jobs);
+
 	string path_str = string(path);
 	if(argc == 2) free(path);
 
 	path_str += PATH_SEP "project.xml";
 	
-	char* root_project = NULL;
-	if ((root_project = load_project(path_str.c_str()))) {
-		//Root project loaded. Parse xml.
-		xml_document<> doc;
-		try{
-			doc.parse<0>(root_project);
-		}
-		catch (rapidxml::parse_error ex) {
-			fprintf(stderr, "Error: Unable to parse project.\n");
-			return 3;
+	//Load each project once and plan every variant, then run all the
+	//variants' actions together.
+	project_plan* root_project = NULL;
+	int result = plan_project(path_str, root_project);
+	int error = 0;
+	string cache_dir;
+	if (result == LOAD_OK) {
+		cache_dir = root_project->dir + PATH_SEP + CACHE_DIR;
+		TOOLCHAINS.load(cache_dir + PATH_SEP "toolchains.cache");
+		COMMANDS.load(cache_dir + PATH_SEP "commands.log");
+	}
+	//Targets named on the command line are built with only what they need;
+	//without any, the whole project is.
+	vector<project_plan*> targets;
+	int bad_target = 0;
+	for (size_t i = 0; result == LOAD_OK && !bad_target && i < target_names.size(); i++) {
+		project_plan* target = NULL;
+		bad_target = find_target(*root_project, target_names[i], target);
+		targets.push_back(target);
+	}
+	if (result == LOAD_OK && target_names.empty()) targets.push_back(root_project);
+	char* cwd = pgetcwd();
+	for (size_t i = 0; result == LOAD_OK && !bad_target && !error && i < VARIANTS.size(); i++) {
+		use_variant(i);
+		for (size_t j = 0; !error && j < targets.size(); j++) {
+			action* done = NULL;
+			chdir(targets[j]->dir.c_str());
+			error = plan_build(*targets[j], done);
+			chdir(cwd);
 		}
-		xml_node<>* p = doc.first_node("project");
-		if (p != NULL) {
-			build_project(p);
+	}
+	free(cwd);
+	if (bad_target) return 1;
+	if (result == LOAD_OK && !error && (FLAGS.gc || root_project->models[0].gc)) {
+		collect_garbage(FLAGS.gc);
+	}
+	if (result == LOAD_OK && !error) {
+		string scan_cache = cache_dir + PATH_SEP "includes.cache";
+		if (FLAGS.scan) INCLUDES.load(scan_cache);
+		error = JOBS.run(GRAPH, FLAGS.jobs);
+		if (FLAGS.scan) {
+			mkdir(cache_dir.c_str());
+			INCLUDES.save(scan_cache);
 		}
-		delete[] root_project;
 	}
-	else {
-		return 2;
+	if (result == LOAD_OK) {
+		//Kept even if the build failed: they only hold what succeeded.
+		mkdir(cache_dir.c_str());
+		TOOLCHAINS.save(cache_dir + PATH_SEP "toolchains.cache");
+		COMMANDS.save(cache_dir + PATH_SEP "commands.log");
 	}
+	if (FLAGS.profile) print_profile();
+	if (result == LOAD_OPEN_FAILED) return 2;
+	if (result == LOAD_PARSE_FAILED) return 3;
 
-	return 0;
+	if (FLAGS.verbose && ARENA.projects > 0) {
+		printf("Parsed %d project files using %zu KB of parse memory (peak pool use %zu KB).\n",
+			ARENA.projects, ARENA.reserved / 1024, ARENA.peak / 1024);
+	}
+
+	return error ? 4 : 0;
 }
+#endif
@@ -131,6 +131,23 @@ namespace rapidxml
     #define RAPIDXML_ALIGNMENT sizeof(void *)
 #endif
 
+///////////////////////////////////////////////////////////////////////////
+// SIMD scanning
+
+#if !defined(RAPIDXML_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+    // Character scanning loops use SSE2 (and AVX2 where the compiler can target it and the cpu supports it).
+    // Define RAPIDXML_NO_SIMD before including rapidxml.hpp to always use the scalar lookup tables.
+    #define RAPIDXML_SIMD 1
+    #include <emmintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #endif
+    #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        #define RAPIDXML_AVX2 1
+        #include <immintrin.h>
+    #endif
+#endif
+
 namespace rapidxml
 {
     // Forward declarations
@@ -335,9 +352,134 @@ namespace rapidxml
             }
             return true;
         }
+
+        // Selected scanning implementation: -1 not yet detected, 0 scalar, 1 SSE2, 2 AVX2.
+        // It must be a template to allow correct linking (because it has static data members, which are defined in a header file).
+        template<int Dummy>
+        struct simd_state
+        {
+            static int level;
+        };
+
+        template<int Dummy>
+        int simd_state<Dummy>::level = -1;
+
+        // Detect the best scanning implementation supported by the cpu
+        inline int detect_simd_level()
+        {
+#if defined(RAPIDXML_AVX2)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return 2;
+#endif
+#if defined(RAPIDXML_SIMD)
+            return 1;
+#else
+            return 0;
+#endif
+        }
+
+        inline int simd_level()
+        {
+            if (simd_state<0>::level < 0)
+                simd_state<0>::level = detect_simd_level();
+            return simd_state<0>::level;
+        }
+
+#if defined(RAPIDXML_SIMD)
+        inline unsigned first_bit(unsigned mask)
+        {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return index;
+#else
+            return __builtin_ctz(mask);
+#endif
+        }
+
+        // Scan for the first character that stops a skip. Set lists the characters of a class:
+        // if Inside, scanning continues while characters are in the set, otherwise it stops at
+        // the first character in the set. Every class stops at the zero terminator, so aligned
+        // loads never touch a page past the end of the text.
+        template<int Count, bool Inside>
+        struct char_scanner
+        {
+            static unsigned stops_sse2(__m128i v, const __m128i *set)
+            {
+                __m128i m = _mm_cmpeq_epi8(v, set[0]);
+                for (int i = 1; i < Count; ++i)
+                    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, set[i]));
+                unsigned r = static_cast<unsigned>(_mm_movemask_epi8(m));
+                return Inside ? (~r & 0xFFFFu) : r;
+            }
+
+            static char *scan_sse2(char *text, const char *chars)
+            {
+                __m128i set[Count];
+                for (int i = 0; i < Count; ++i)
+                    set[i] = _mm_set1_epi8(chars[i]);
+                std::size_t offset = reinterpret_cast<std::size_t>(text) & 15;
+                const __m128i *block = reinterpret_cast<const __m128i *>(text - offset);
+                unsigned stops = stops_sse2(_mm_load_si128(block), set) & (0xFFFFu << offset);
+                while (!stops)
+                    stops = stops_sse2(_mm_load_si128(++block), set);
+                return reinterpret_cast<char *>(const_cast<__m128i *>(block)) + first_bit(stops);
+            }
+
+#if defined(RAPIDXML_AVX2)
+            __attribute__((target("avx2")))
+            static unsigned stops_avx2(__m256i v, const __m256i *set)
+            {
+                __m256i m = _mm256_cmpeq_epi8(v, set[0]);
+                for (int i = 1; i < Count; ++i)
+                    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, set[i]));
+                unsigned r = static_cast<unsigned>(_mm256_movemask_epi8(m));
+                return Inside ? ~r : r;
+            }
+
+            __attribute__((target("avx2")))
+            static char *scan_avx2(char *text, const char *chars)
+            {
+                __m256i set[Count];
+                for (int i = 0; i < Count; ++i)
+                    set[i] = _mm256_set1_epi8(chars[i]);
+                std::size_t offset = reinterpret_cast<std::size_t>(text) & 31;
+                const __m256i *block = reinterpret_cast<const __m256i *>(text - offset);
+                unsigned stops = stops_avx2(_mm256_load_si256(block), set) & (0xFFFFFFFFu << offset);
+                while (!stops)
+                    stops = stops_avx2(_mm256_load_si256(++block), set);
+                return reinterpret_cast<char *>(const_cast<__m256i *>(block)) + first_bit(stops);
+            }
+#endif
+
+            template<class Ch>
+            static Ch *scan(Ch *text, const char *chars)
+            {
+                char *p = reinterpret_cast<char *>(text);
+#if defined(RAPIDXML_AVX2)
+                if (simd_state<0>::level == 2)
+                    return reinterpret_cast<Ch *>(scan_avx2(p, chars));
+#endif
+                return reinterpret_cast<Ch *>(scan_sse2(p, chars));
+            }
+        };
+#endif
     }
     //! \endcond
 
+    //! Selects the character scanning implementation used by the parser: 0 for the scalar lookup
+    //! tables, 1 for SSE2, 2 for AVX2. Levels not supported by the build or cpu fall back to the best
+    //! supported one. By default the best supported level is detected on first use.
+    //! \param level Scanning implementation to use.
+    //! \return Selected level.
+    inline int set_simd_level(int level)
+    {
+        int best = internal::detect_simd_level();
+        internal::simd_state<0>::level = level < 0 || level > best ? best : level;
+        return internal::simd_state<0>::level;
+    }
+
     ///////////////////////////////////////////////////////////////////////
     // Memory pool
     
@@ -1431,6 +1573,13 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_whitespace[static_cast<unsigned char>(ch)];
             }
+#if defined(RAPIDXML_SIMD)
+            static Ch *scan(Ch *text)
+            {
+                static const char chars[] = { ' ', '\t', '\n', '\r' };
+                return internal::char_scanner<4, true>::scan(text, chars);
+            }
+#endif
         };
 
         // Detect node name character
@@ -1440,6 +1589,13 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_node_name[static_cast<unsigned char>(ch)];
             }
+#if defined(RAPIDXML_SIMD)
+            static Ch *scan(Ch *text)
+            {
+                static const char chars[] = { '\0', ' ', '\t', '\n', '\r', '/', '>', '?' };
+                return internal::char_scanner<8, false>::scan(text, chars);
+            }
+#endif
         };
 
         // Detect attribute name character
@@ -1449,6 +1605,13 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_attribute_name[static_cast<unsigned char>(ch)];
             }
+#if defined(RAPIDXML_SIMD)
+            static Ch *scan(Ch *text)
+            {
+                static const char chars[] = { '\0', ' ', '\t', '\n', '\r', '!', '/', '<', '=', '>', '?' };
+                return internal::char_scanner<11, false>::scan(text, chars);
+            }
+#endif
         };
 
         // Detect text character (PCDATA)
@@ -1458,6 +1621,13 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_text[static_cast<unsigned char>(ch)];
             }
+#if defined(RAPIDXML_SIMD)
+            static Ch *scan(Ch *text)
+            {
+                static const char chars[] = { '\0', '<' };
+                return internal::char_scanner<2, false>::scan(text, chars);
+            }
+#endif
         };
 
         // Detect text character (PCDATA) that does not require processing
@@ -1467,6 +1637,13 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_text_pure_no_ws[static_cast<unsigned char>(ch)];
             }
+#if defined(RAPIDXML_SIMD)
+            static Ch *scan(Ch *text)
+            {
+                static const char chars[] = { '\0', '&', '<' };
+                return internal::char_scanner<3, false>::scan(text, chars);
+            }
+#endif
         };
 
         // Detect text character (PCDATA) that does not require processing
@@ -1476,6 +1653,13 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_text_pure_with_ws[static_cast<unsigned char>(ch)];
             }
+#if defined(RAPIDXML_SIMD)
+            static Ch *scan(Ch *text)
+            {
+                static const char chars[] = { '\0', ' ', '\t', '\n', '\r', '&', '<' };
+                return internal::char_scanner<7, false>::scan(text, chars);
+            }
+#endif
         };
 
         // Detect attribute value character
@@ -1490,6 +1674,13 @@ namespace rapidxml
                     return internal::lookup_tables<0>::lookup_attribute_data_2[static_cast<unsigned char>(ch)];
                 return 0;       // Should never be executed, to avoid warnings on Comeau
             }
+#if defined(RAPIDXML_SIMD)
+            static Ch *scan(Ch *text)
+            {
+                static const char chars[] = { '\0', static_cast<char>(Quote) };
+                return internal::char_scanner<2, false>::scan(text, chars);
+            }
+#endif
         };
 
         // Detect attribute value character
@@ -1504,6 +1695,13 @@ namespace rapidxml
                     return internal::lookup_tables<0>::lookup_attribute_data_2_pure[static_cast<unsigned char>(ch)];
                 return 0;       // Should never be executed, to avoid warnings on Comeau
             }
+#if defined(RAPIDXML_SIMD)
+            static Ch *scan(Ch *text)
+            {
+                static const char chars[] = { '\0', static_cast<char>(Quote), '&' };
+                return internal::char_scanner<3, false>::scan(text, chars);
+            }
+#endif
         };
 
         // Insert coded character, using UTF8 or 8-bit ASCII
@@ -1558,6 +1756,25 @@ namespace rapidxml
         static void skip(Ch *&text)
         {
             Ch *tmp = text;
+#if defined(RAPIDXML_SIMD)
+            // Most runs are short (single spaces, names, small values), so the
+            // first characters are tested with the tables and only longer runs
+            // are scanned in blocks.
+            if (sizeof(Ch) == 1)
+            {
+                for (Ch *probe = tmp + 16; tmp < probe; ++tmp)
+                    if (!StopPred::test(*tmp))
+                    {
+                        text = tmp;
+                        return;
+                    }
+                if (internal::simd_level() > 0)
+                {
+                    text = StopPred::scan(tmp);
+                    return;
+                }
+            }
+#endif
             while (StopPred::test(*tmp))
                 ++tmp;
             text = tmp;